@@ -0,0 +1,213 @@
+// Copyright (c) 2021 Marvin Borner
+
+// Renders every page of .note documents through the plugin entry points and reports
+// open time, per-page render percentiles and peak RSS
+
+#include "host.h"
+
+#include "../zathura-note/note.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+static double now(void)
+{
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec * 1e3 + time.tv_nsec / 1e6;
+}
+
+static long peak_rss(void)
+{
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage))
+		return -1;
+	return usage.ru_maxrss; // KiB on Linux
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, size_t length, double p)
+{
+	if (!length)
+		return 0;
+	size_t index = (size_t)(p * (length - 1) + 0.5);
+	return sorted[index];
+}
+
+static cairo_t *render_target(zathura_page_t *page, double scale)
+{
+	int width = zathura_page_get_width(page) * scale + 0.5;
+	int height = zathura_page_get_height(page) * scale + 0.5;
+	cairo_surface_t *surface =
+		cairo_image_surface_create(CAIRO_FORMAT_RGB24, width > 0 ? width : 1,
+					   height > 0 ? height : 1);
+	cairo_t *cairo = cairo_create(surface);
+	cairo_surface_destroy(surface);
+
+	// Zathura clears the surface before rendering as well
+	cairo_set_source_rgb(cairo, 1, 1, 1);
+	cairo_paint(cairo);
+	cairo_scale(cairo, scale, scale);
+	return cairo;
+}
+
+static void print_times(const char *name, double *times, size_t length)
+{
+	qsort(times, length, sizeof(*times), compare_doubles);
+	printf("  %s p50:%*s%.3f ms\n", name, (int)(11 - strlen(name)), "",
+	       percentile(times, length, 0.50));
+	printf("  %s p99:%*s%.3f ms\n", name, (int)(11 - strlen(name)), "",
+	       percentile(times, length, 0.99));
+	printf("  %s max:%*s%.3f ms\n", name, (int)(11 - strlen(name)), "",
+	       percentile(times, length, 1));
+}
+
+static int bench(const char *path, double scale, int iterations, int preview, const char *dump)
+{
+	zathura_document_t *document = host_document_new(path);
+
+	double start = now();
+	if (note_document_open(document) != ZATHURA_ERROR_OK) {
+		fprintf(stderr, "Couldn't open %s\n", path);
+		host_document_free(document);
+		return 1;
+	}
+	double open_time = now() - start;
+
+	unsigned int page_count = zathura_document_get_number_of_pages(document);
+	zathura_page_t **pages = calloc(page_count, sizeof(*pages));
+	start = now();
+	for (unsigned int i = 0; i < page_count; i++) {
+		pages[i] = host_page_new(document, i);
+		note_page_init(pages[i]);
+	}
+	double init_time = now() - start;
+
+	size_t times_length = (size_t)page_count * iterations;
+	double *times = malloc((times_length ? times_length : 1) * sizeof(*times));
+	double *preview_times = malloc((times_length ? times_length : 1) * sizeof(*times));
+	size_t index = 0;
+	double first_time = 0;
+	for (int iteration = 0; iteration < iterations; iteration++) {
+		for (unsigned int i = 0; i < page_count; i++) {
+			cairo_t *cairo = render_target(pages[i], scale);
+
+			// Like scrolling: The preview shows first, the full render replaces it
+			if (preview) {
+				start = now();
+				note_page_render_preview(pages[i], zathura_page_get_data(pages[i]),
+							 cairo);
+				cairo_surface_flush(cairo_get_target(cairo));
+				preview_times[index] = now() - start;
+			}
+
+			start = now();
+			note_page_render_cairo(pages[i], zathura_page_get_data(pages[i]), cairo,
+					       false);
+			cairo_surface_flush(cairo_get_target(cairo));
+			times[index] = now() - start;
+			if (!iteration)
+				first_time += times[index];
+			index++;
+
+			if (dump && !iteration) {
+				char name[4096];
+				snprintf(name, sizeof(name), "%s/page-%04u.png", dump, i);
+				cairo_surface_write_to_png(cairo_get_target(cairo), name);
+			}
+			cairo_destroy(cairo);
+		}
+	}
+
+	double total_time = 0;
+	for (size_t i = 0; i < times_length; i++)
+		total_time += times[i];
+
+	printf("%s\n", path);
+	printf("  pages:          %u\n", page_count);
+	printf("  open:           %.3f ms\n", open_time);
+	printf("  page init:      %.3f ms\n", init_time);
+	printf("  first pass:     %.3f ms\n", first_time);
+	printf("  render total:   %.3f ms (%lu renders at scale %.2f)\n", total_time,
+	       times_length, scale);
+	print_times("render", times, times_length);
+	if (preview)
+		print_times("preview", preview_times, times_length);
+
+	for (unsigned int i = 0; i < page_count; i++) {
+		note_page_clear(pages[i], zathura_page_get_data(pages[i]));
+		host_page_free(pages[i]);
+	}
+	free(pages);
+	free(times);
+	free(preview_times);
+
+	start = now();
+	note_document_free(document, zathura_document_get_data(document));
+	printf("  close:          %.3f ms\n", now() - start);
+	printf("  peak rss:       %ld KiB\n", peak_rss());
+
+	host_document_free(document);
+	return 0;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [--scale S] [--iterations N] [--preview] [--cache] [--dump DIR] "
+		"FILE...\n"
+		"  --scale S       Render scale (default 1)\n"
+		"  --iterations N  Render every page N times (default 3)\n"
+		"  --preview       Render a preview before every render and time it too\n"
+		"  --cache         Use the index cache instead of parsing every time\n"
+		"  --dump DIR      Write the first pass of every page as PNG into DIR\n",
+		name);
+}
+
+int main(int argc, char *argv[])
+{
+	double scale = 1;
+	int iterations = 3;
+	int cache = 0, preview = 0;
+	const char *dump = NULL;
+
+	int i = 1;
+	for (; i < argc && argv[i][0] == '-'; i++) {
+		if (!strcmp(argv[i], "--scale") && i + 1 < argc) {
+			scale = strtod(argv[++i], NULL);
+		} else if (!strcmp(argv[i], "--iterations") && i + 1 < argc) {
+			iterations = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--preview")) {
+			preview = 1;
+		} else if (!strcmp(argv[i], "--cache")) {
+			cache = 1;
+		} else if (!strcmp(argv[i], "--dump") && i + 1 < argc) {
+			dump = argv[++i];
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (i >= argc || scale <= 0 || iterations < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	// Measure the cold path unless asked otherwise
+	if (!cache)
+		setenv("ZATHURA_NOTE_CACHE", "0", 1);
+
+	int ret = 0;
+	for (; i < argc; i++)
+		ret |= bench(argv[i], scale, iterations, preview, dump);
+	return ret;
+}
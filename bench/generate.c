@@ -0,0 +1,554 @@
+// Copyright (c) 2021 Marvin Borner
+
+// Writes synthetic .note archives in the layout the plugin understands (NSKeyedArchiver
+// $objects with the general info at 1 and the global text store at 2)
+
+#include <cairo.h>
+#include <math.h>
+#include <plist/plist.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zip.h>
+
+#include <jpeglib.h>
+
+#define ROOT_NAME "Synthetic"
+#define PAGE_WIDTH 576
+#define PAGE_RATIO 1.3 // Legacy:13
+
+typedef struct {
+	int pages;
+	int strokes;
+	int points; // Average number of points per stroke
+	int images;
+	int image_size; // Pixels of the longer image side
+	int texts; // Text block media objects
+	int runs; // Text runs in the global text store
+	int seed;
+} generate_options_t;
+
+typedef struct {
+	plist_t objects;
+	uint64_t state;
+
+	// Shared archive objects
+	uint64_t image_class, text_class, locked_class;
+	uint64_t key_range, key_font, key_color;
+	uint64_t font_name_key, font_size_key, font_names[3];
+} generator_t;
+
+/**
+ * Random numbers (deterministic per seed)
+ */
+
+static uint32_t next(generator_t *generator)
+{
+	// xorshift64*
+	generator->state ^= generator->state >> 12;
+	generator->state ^= generator->state << 25;
+	generator->state ^= generator->state >> 27;
+	return (generator->state * 2685821657736338717ull) >> 32;
+}
+
+static double uniform(generator_t *generator, double min, double max)
+{
+	return min + (max - min) * (next(generator) / 4294967296.0);
+}
+
+/**
+ * Archive helpers
+ */
+
+static uint64_t add(generator_t *generator, plist_t node)
+{
+	plist_array_append_item(generator->objects, node);
+	return plist_array_get_size(generator->objects) - 1;
+}
+
+static plist_t ref(generator_t *generator, plist_t node)
+{
+	return plist_new_uid(add(generator, node));
+}
+
+static uint64_t add_class(generator_t *generator, const char *name)
+{
+	plist_t class = plist_new_dict();
+	plist_dict_set_item(class, "$classname", plist_new_string(name));
+	plist_t classes = plist_new_array();
+	plist_array_append_item(classes, plist_new_string(name));
+	plist_array_append_item(classes, plist_new_string("NSObject"));
+	plist_dict_set_item(class, "$classes", classes);
+	return add(generator, class);
+}
+
+static plist_t new_pair(double a, double b)
+{
+	char string[64];
+	snprintf(string, sizeof(string), "{%g, %g}", a, b);
+	return plist_new_string(string);
+}
+
+static plist_t new_text_run(generator_t *generator, size_t start, size_t length)
+{
+	plist_t font = plist_new_dict();
+	plist_t font_keys = plist_new_array();
+	plist_array_append_item(font_keys, plist_new_uid(generator->font_name_key));
+	plist_array_append_item(font_keys, plist_new_uid(generator->font_size_key));
+	plist_dict_set_item(font, "NS.keys", font_keys);
+	plist_t font_objects = plist_new_array();
+	plist_array_append_item(font_objects,
+				plist_new_uid(generator->font_names[next(generator) % 3]));
+	plist_array_append_item(font_objects, plist_new_real(10 + next(generator) % 4 * 4));
+	plist_dict_set_item(font, "NS.objects", font_objects);
+
+	plist_t color = plist_new_dict();
+	plist_dict_set_item(color, "UIRed", plist_new_real(uniform(generator, 0, 0.5)));
+	plist_dict_set_item(color, "UIGreen", plist_new_real(uniform(generator, 0, 0.5)));
+	plist_dict_set_item(color, "UIBlue", plist_new_real(uniform(generator, 0, 0.5)));
+	plist_dict_set_item(color, "UIAlpha", plist_new_real(1));
+
+	plist_t run = plist_new_dict();
+	plist_t keys = plist_new_array();
+	plist_array_append_item(keys, plist_new_uid(generator->key_range));
+	plist_array_append_item(keys, plist_new_uid(generator->key_font));
+	plist_array_append_item(keys, plist_new_uid(generator->key_color));
+	plist_dict_set_item(run, "NS.keys", keys);
+	plist_t objects = plist_new_array();
+	plist_array_append_item(objects, ref(generator, new_pair(start, length)));
+	plist_array_append_item(objects, ref(generator, font));
+	plist_array_append_item(objects, ref(generator, color));
+	plist_dict_set_item(run, "NS.objects", objects);
+	return run;
+}
+
+// Fills a text store with runs paragraphs of filler words, one run per paragraph
+static void fill_text_store(generator_t *generator, plist_t store, int runs)
+{
+	static const char *words[] = { "lorem", "ipsum",  "dolor", "sit",	"amet",
+				       "note",	"stroke", "page",  "render", "cairo" };
+
+	size_t capacity = 64, length = 0;
+	char *text = malloc(capacity);
+	plist_t run_array = plist_new_array();
+	for (int i = 0; i < runs; i++) {
+		size_t start = length;
+		int count = 3 + next(generator) % 12;
+		for (int j = 0; j < count; j++) {
+			const char *word = words[next(generator) % 10];
+			size_t word_length = strlen(word);
+			if (length + word_length + 2 > capacity) {
+				capacity = (capacity + word_length) * 2;
+				text = realloc(text, capacity);
+			}
+			memcpy(text + length, word, word_length);
+			length += word_length;
+			text[length++] = j + 1 < count ? ' ' : '\n';
+		}
+		plist_t run = new_text_run(generator, start, length - start);
+		plist_array_append_item(run_array, ref(generator, run));
+	}
+
+	plist_t bytes = plist_new_dict();
+	plist_dict_set_item(bytes, "NS.bytes", plist_new_data(text, length));
+	free(text);
+	plist_t run_store = plist_new_dict();
+	plist_dict_set_item(run_store, "NS.objects", run_array);
+
+	plist_t coded = plist_new_array();
+	plist_array_append_item(coded, ref(generator, bytes));
+	plist_array_append_item(coded, ref(generator, run_store));
+	plist_t coding = plist_new_dict();
+	plist_dict_set_item(coding, "NS.objects", coded);
+	plist_t backing = plist_new_dict();
+	plist_dict_set_item(backing, "NBAttributedBackingStringCodingKey", ref(generator, coding));
+	plist_dict_set_item(store, "NBAttributedBackingString", ref(generator, backing));
+}
+
+/**
+ * Content generation
+ */
+
+static void generate_strokes(generator_t *generator, plist_t overlay,
+			     const generate_options_t *options)
+{
+	double page_height = PAGE_WIDTH * PAGE_RATIO;
+
+	size_t points_capacity = (size_t)options->strokes * options->points * 2 + 1;
+	float *points = malloc(points_capacity * sizeof(*points));
+	uint32_t *num_points = malloc((options->strokes + 1) * sizeof(*num_points));
+	float *widths = malloc((options->strokes + 1) * sizeof(*widths));
+	unsigned char *colors = malloc((options->strokes + 1) * 4);
+
+	size_t points_length = 0;
+	for (int i = 0; i < options->strokes; i++) {
+		// Spread strokes evenly so every page gets some (and the last page exists)
+		int page = i % options->pages;
+		int count = 2 + next(generator) % (options->points * 2 - 1);
+		if (points_length + count * 2 > points_capacity) {
+			points_capacity = (points_capacity + count * 2) * 2;
+			points = realloc(points, points_capacity * sizeof(*points));
+		}
+
+		// Smooth random walk like handwriting
+		double x = uniform(generator, 20, PAGE_WIDTH - 20);
+		double y = page * page_height + uniform(generator, 20, page_height - 20);
+		double angle = uniform(generator, 0, 6.283);
+		for (int j = 0; j < count; j++) {
+			angle += uniform(generator, -0.4, 0.4);
+			x += cos(angle) * 2;
+			y += sin(angle) * 2;
+			points[points_length++] = x;
+			points[points_length++] = y;
+		}
+
+		num_points[i] = count;
+		widths[i] = uniform(generator, 0.5, 4);
+		int highlighter = next(generator) % 10 == 0;
+		colors[i * 4 + 0] = next(generator) % 128;
+		colors[i * 4 + 1] = next(generator) % 128;
+		colors[i * 4 + 2] = next(generator) % 256;
+		colors[i * 4 + 3] = highlighter ? 96 : 255;
+		if (highlighter)
+			widths[i] *= 4;
+	}
+
+	plist_dict_set_item(overlay, "curvespoints",
+			    plist_new_data((char *)points, points_length * sizeof(*points)));
+	plist_dict_set_item(overlay, "curvesnumpoints",
+			    plist_new_data((char *)num_points,
+					   options->strokes * sizeof(*num_points)));
+	plist_dict_set_item(overlay, "curveswidth",
+			    plist_new_data((char *)widths, options->strokes * sizeof(*widths)));
+	plist_dict_set_item(overlay, "curvescolors",
+			    plist_new_data((char *)colors, options->strokes * 4));
+
+	free(points);
+	free(num_points);
+	free(widths);
+	free(colors);
+}
+
+typedef struct {
+	unsigned char *data;
+	size_t length, capacity;
+} buffer_t;
+
+static cairo_status_t buffer_write(void *closure, const unsigned char *data, unsigned int length)
+{
+	buffer_t *buffer = closure;
+	if (buffer->length + length > buffer->capacity) {
+		buffer->capacity = (buffer->length + length) * 2;
+		buffer->data = realloc(buffer->data, buffer->capacity);
+	}
+	memcpy(buffer->data + buffer->length, data, length);
+	buffer->length += length;
+	return CAIRO_STATUS_SUCCESS;
+}
+
+// Noisy gradient so the encoders have to do real work
+static unsigned char *image_pixels(generator_t *generator, int width, int height)
+{
+	unsigned char *pixels = malloc((size_t)width * height * 3);
+	int red = next(generator) % 256, green = next(generator) % 256;
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < width; x++) {
+			unsigned char *pixel = &pixels[((size_t)y * width + x) * 3];
+			pixel[0] = (red + x * 255 / width) & 0xff;
+			pixel[1] = (green + y * 255 / height) & 0xff;
+			pixel[2] = next(generator) & 0x3f;
+		}
+	}
+	return pixels;
+}
+
+static void encode_png(const unsigned char *pixels, int width, int height, buffer_t *buffer)
+{
+	cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_RGB24, width, height);
+	unsigned char *data = cairo_image_surface_get_data(surface);
+	int stride = cairo_image_surface_get_stride(surface);
+	for (int y = 0; y < height; y++) {
+		uint32_t *row = (uint32_t *)(data + (size_t)y * stride);
+		for (int x = 0; x < width; x++) {
+			const unsigned char *pixel = &pixels[((size_t)y * width + x) * 3];
+			row[x] = (uint32_t)pixel[0] << 16 | (uint32_t)pixel[1] << 8 | pixel[2];
+		}
+	}
+	cairo_surface_mark_dirty(surface);
+	cairo_surface_write_to_png_stream(surface, buffer_write, buffer);
+	cairo_surface_destroy(surface);
+}
+
+static void encode_jpeg(const unsigned char *pixels, int width, int height, buffer_t *buffer)
+{
+	struct jpeg_compress_struct info;
+	struct jpeg_error_mgr error;
+	info.err = jpeg_std_error(&error);
+	jpeg_create_compress(&info);
+
+	unsigned char *data = NULL;
+	unsigned long length = 0;
+	jpeg_mem_dest(&info, &data, &length);
+
+	info.image_width = width;
+	info.image_height = height;
+	info.input_components = 3;
+	info.in_color_space = JCS_RGB;
+	jpeg_set_defaults(&info);
+	jpeg_set_quality(&info, 85, TRUE);
+	jpeg_start_compress(&info, TRUE);
+	while (info.next_scanline < info.image_height) {
+		JSAMPROW row = (JSAMPROW)&pixels[(size_t)info.next_scanline * width * 3];
+		jpeg_write_scanlines(&info, &row, 1);
+	}
+	jpeg_finish_compress(&info);
+	jpeg_destroy_compress(&info);
+
+	buffer->data = data;
+	buffer->length = buffer->capacity = length;
+}
+
+static int add_file(zip_t *zip, const char *path, void *data, size_t length)
+{
+	char name[1024];
+	snprintf(name, sizeof(name), "%s/%s", ROOT_NAME, path);
+	zip_source_t *source = zip_source_buffer(zip, data, length, 1);
+	if (!source || zip_file_add(zip, name, source, ZIP_FL_OVERWRITE) < 0) {
+		fprintf(stderr, "Couldn't add %s: %s\n", name, zip_strerror(zip));
+		zip_source_free(source);
+		return 0;
+	}
+	return 1;
+}
+
+static plist_t new_image_object(generator_t *generator, zip_t *zip, int index,
+				const generate_options_t *options)
+{
+	int is_jpeg = index % 2;
+	int width = options->image_size;
+	int height = options->image_size * uniform(generator, 0.5, 1);
+
+	char path[64];
+	snprintf(path, sizeof(path), "Images/image-%d.%s", index, is_jpeg ? "jpg" : "png");
+
+	unsigned char *pixels = image_pixels(generator, width, height);
+	buffer_t buffer = { 0 };
+	if (is_jpeg)
+		encode_jpeg(pixels, width, height, &buffer);
+	else
+		encode_png(pixels, width, height, &buffer);
+	free(pixels);
+	if (!add_file(zip, path, buffer.data, buffer.length))
+		return 0;
+
+	plist_t snapshot = plist_new_dict();
+	plist_dict_set_item(snapshot, "imageIsMissing", plist_new_bool(0));
+	plist_dict_set_item(snapshot, "relativePath", plist_new_string(path));
+	plist_dict_set_item(snapshot, "saveAsJPEG", plist_new_bool(is_jpeg));
+	plist_t background = plist_new_dict();
+	plist_dict_set_item(background, "kImageObjectSnapshotKey", ref(generator, snapshot));
+	plist_t figure = plist_new_dict();
+	plist_dict_set_item(figure, "FigureBackgroundObjectKey", ref(generator, background));
+
+	// Displayed at roughly a third of the page width
+	double display_width = uniform(generator, 0.2, 0.5) * PAGE_WIDTH;
+	double display_height = display_width * height / width;
+	double page_height = PAGE_WIDTH * PAGE_RATIO;
+	int page = index % options->pages;
+
+	plist_t object = plist_new_dict();
+	plist_dict_set_item(object, "$class", plist_new_uid(generator->image_class));
+	double x = uniform(generator, 0, PAGE_WIDTH - display_width);
+	double y = page * page_height + uniform(generator, 0, page_height - display_height);
+	plist_dict_set_item(object, "documentContentOrigin", ref(generator, new_pair(x, y)));
+	plist_dict_set_item(object, "unscaledContentSize",
+			    ref(generator, new_pair(display_width, display_height)));
+	plist_dict_set_item(object, "figure", ref(generator, figure));
+	return object;
+}
+
+static plist_t new_text_object(generator_t *generator, int index,
+			       const generate_options_t *options)
+{
+	plist_t store = plist_new_dict();
+	fill_text_store(generator, store, 1 + next(generator) % 4);
+
+	double page_height = PAGE_WIDTH * PAGE_RATIO;
+	int page = index % options->pages;
+
+	plist_t object = plist_new_dict();
+	plist_dict_set_item(object, "$class", plist_new_uid(generator->text_class));
+	double x = uniform(generator, 0, PAGE_WIDTH / 2);
+	double y = page * page_height + uniform(generator, 0, page_height / 2);
+	plist_dict_set_item(object, "documentContentOrigin", ref(generator, new_pair(x, y)));
+	plist_dict_set_item(object, "unscaledContentSize",
+			    ref(generator, new_pair(PAGE_WIDTH / 2, 100)));
+	plist_dict_set_item(object, "textStore", ref(generator, store));
+	return object;
+}
+
+static int generate(const char *path, const generate_options_t *options)
+{
+	int error;
+	zip_t *zip = zip_open(path, ZIP_CREATE | ZIP_TRUNCATE, &error);
+	if (!zip) {
+		fprintf(stderr, "Couldn't create %s (%d)\n", path, error);
+		return 1;
+	}
+
+	generator_t generator = { 0 };
+	generator.state = (uint64_t)options->seed * 0x9e3779b97f4a7c15ull + 1;
+	generator.objects = plist_new_array();
+
+	plist_array_append_item(generator.objects, plist_new_string("$null"));
+	plist_t general_info = plist_new_dict();
+	add(&generator, general_info); // SESSION_OBJECTS_GENERAL_INFO
+	plist_t global_store = plist_new_dict();
+	add(&generator, global_store); // SESSION_OBJECTS_GLOBAL_TEXT_STORE
+
+	generator.image_class = add_class(&generator, "ImageMediaObject");
+	generator.text_class = add_class(&generator, "TextBlockMediaObject");
+	generator.locked_class = add_class(&generator, "NBReflowStateLocked");
+	generator.key_range = add(&generator, plist_new_string("subRangeRangeKey"));
+	generator.key_font = add(&generator, plist_new_string("subRangeFontKey"));
+	generator.key_color = add(&generator, plist_new_string("subRangeColorKey"));
+	generator.font_name_key = add(&generator, plist_new_string("NSFontNameAttribute"));
+	generator.font_size_key = add(&generator, plist_new_string("NSFontSizeAttribute"));
+	generator.font_names[0] = add(&generator, plist_new_string("Helvetica"));
+	generator.font_names[1] = add(&generator, plist_new_string("Times-Roman"));
+	generator.font_names[2] = add(&generator, plist_new_string("Courier"));
+
+	// General info
+	plist_t attributes = plist_new_dict();
+	plist_dict_set_item(attributes, "paperIdentifier",
+			    ref(&generator, plist_new_string("Legacy:13")));
+	plist_t layout = plist_new_dict();
+	plist_dict_set_item(layout, "documentPaperAttributes", ref(&generator, attributes));
+	plist_dict_set_item(general_info, "NBNoteTakingSessionDocumentPaperLayoutModelKey",
+			    ref(&generator, layout));
+
+	// Global text store
+	plist_t reflow = plist_new_dict();
+	plist_dict_set_item(reflow, "$class", plist_new_uid(generator.locked_class));
+	plist_dict_set_item(reflow, "pageWidthInDocumentCoordsKey", plist_new_real(PAGE_WIDTH));
+	plist_dict_set_item(global_store, "reflowState", ref(&generator, reflow));
+
+	plist_t spatial_hash = plist_new_dict();
+	generate_strokes(&generator, spatial_hash, options);
+	plist_t overlay = plist_new_dict();
+	plist_dict_set_item(overlay, "SpatialHash", ref(&generator, spatial_hash));
+	plist_dict_set_item(global_store, "Handwriting Overlay", ref(&generator, overlay));
+
+	if (options->runs)
+		fill_text_store(&generator, global_store, options->runs);
+
+	// The plugin takes the root directory from the first entry
+	if (zip_dir_add(zip, ROOT_NAME, 0) < 0) {
+		fprintf(stderr, "Couldn't add %s: %s\n", ROOT_NAME, zip_strerror(zip));
+		zip_discard(zip);
+		return 1;
+	}
+
+	plist_t media = plist_new_array();
+	for (int i = 0; i < options->images; i++) {
+		plist_t object = new_image_object(&generator, zip, i, options);
+		if (object)
+			plist_array_append_item(media, ref(&generator, object));
+	}
+	for (int i = 0; i < options->texts; i++)
+		plist_array_append_item(media,
+					ref(&generator, new_text_object(&generator, i, options)));
+	plist_t media_objects = plist_new_dict();
+	plist_dict_set_item(media_objects, "NS.objects", media);
+	plist_dict_set_item(global_store, "mediaObjects", ref(&generator, media_objects));
+
+	plist_t session = plist_new_dict();
+	plist_dict_set_item(session, "$archiver", plist_new_string("NSKeyedArchiver"));
+	plist_dict_set_item(session, "$version", plist_new_uint(100000));
+	plist_t top = plist_new_dict();
+	plist_dict_set_item(top, "root", plist_new_uid(1));
+	plist_dict_set_item(session, "$top", top);
+	plist_dict_set_item(session, "$objects", generator.objects);
+
+	char *bin = NULL;
+	uint32_t length = 0;
+	plist_to_bin(session, &bin, &length);
+	plist_free(session);
+	if (!bin || !add_file(zip, "Session.plist", bin, length)) {
+		zip_discard(zip);
+		return 1;
+	}
+
+	if (zip_close(zip) < 0) {
+		fprintf(stderr, "Couldn't write %s: %s\n", path, zip_strerror(zip));
+		zip_discard(zip);
+		return 1;
+	}
+
+	return 0;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [options] OUTPUT\n"
+		"  --pages N       Number of pages (default 20)\n"
+		"  --strokes N     Number of strokes (default 20000)\n"
+		"  --points N      Average points per stroke (default 40)\n"
+		"  --images N      Number of images, alternating PNG/JPEG (default 10)\n"
+		"  --image-size N  Longer image side in pixels (default 1024)\n"
+		"  --texts N       Number of text block objects (default 10)\n"
+		"  --runs N        Text runs in the global text store (default 200)\n"
+		"  --seed N        Random seed (default 1)\n",
+		name);
+}
+
+int main(int argc, char *argv[])
+{
+	generate_options_t options = {
+		.pages = 20,
+		.strokes = 20000,
+		.points = 40,
+		.images = 10,
+		.image_size = 1024,
+		.texts = 10,
+		.runs = 200,
+		.seed = 1,
+	};
+
+	struct {
+		const char *name;
+		int *value;
+	} flags[] = {
+		{ "--pages", &options.pages },	 { "--strokes", &options.strokes },
+		{ "--points", &options.points }, { "--images", &options.images },
+		{ "--image-size", &options.image_size },
+		{ "--texts", &options.texts },	 { "--runs", &options.runs },
+		{ "--seed", &options.seed },
+	};
+
+	int i = 1;
+	for (; i + 1 < argc && argv[i][0] == '-'; i += 2) {
+		size_t j;
+		for (j = 0; j < sizeof(flags) / sizeof(*flags); j++) {
+			if (!strcmp(argv[i], flags[j].name)) {
+				*flags[j].value = atoi(argv[i + 1]);
+				break;
+			}
+		}
+		if (j == sizeof(flags) / sizeof(*flags)) {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (i + 1 != argc || options.pages < 1 || options.strokes < 0 || options.points < 1 ||
+	    options.images < 0 || options.image_size < 1 || options.texts < 0 ||
+	    options.runs < 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	return generate(argv[i], &options);
+}
@@ -0,0 +1,114 @@
+// Copyright (c) 2021 Marvin Borner
+
+// Minimal stand-in for the parts of zathura the plugin uses, so the plugin code can
+// be driven without the zathura UI
+
+#include "host.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+struct zathura_document_s {
+	char *path;
+	void *data;
+	unsigned int number_of_pages;
+};
+
+struct zathura_page_s {
+	zathura_document_t *document;
+	unsigned int index;
+	double width, height;
+	void *data;
+};
+
+zathura_document_t *host_document_new(const char *path)
+{
+	zathura_document_t *document = calloc(1, sizeof(*document));
+	document->path = strdup(path);
+	return document;
+}
+
+void host_document_free(zathura_document_t *document)
+{
+	free(document->path);
+	free(document);
+}
+
+zathura_page_t *host_page_new(zathura_document_t *document, unsigned int index)
+{
+	zathura_page_t *page = calloc(1, sizeof(*page));
+	page->document = document;
+	page->index = index;
+	return page;
+}
+
+void host_page_free(zathura_page_t *page)
+{
+	free(page);
+}
+
+const char *zathura_document_get_path(zathura_document_t *document)
+{
+	return document->path;
+}
+
+void *zathura_document_get_data(zathura_document_t *document)
+{
+	return document->data;
+}
+
+void zathura_document_set_data(zathura_document_t *document, void *data)
+{
+	document->data = data;
+}
+
+unsigned int zathura_document_get_number_of_pages(zathura_document_t *document)
+{
+	return document->number_of_pages;
+}
+
+void zathura_document_set_number_of_pages(zathura_document_t *document,
+					  unsigned int number_of_pages)
+{
+	document->number_of_pages = number_of_pages;
+}
+
+zathura_document_t *zathura_page_get_document(zathura_page_t *page)
+{
+	return page->document;
+}
+
+unsigned int zathura_page_get_index(zathura_page_t *page)
+{
+	return page->index;
+}
+
+double zathura_page_get_width(zathura_page_t *page)
+{
+	return page->width;
+}
+
+void zathura_page_set_width(zathura_page_t *page, double width)
+{
+	page->width = width;
+}
+
+double zathura_page_get_height(zathura_page_t *page)
+{
+	return page->height;
+}
+
+void zathura_page_set_height(zathura_page_t *page, double height)
+{
+	page->height = height;
+}
+
+void *zathura_page_get_data(zathura_page_t *page)
+{
+	return page->data;
+}
+
+void zathura_page_set_data(zathura_page_t *page, void *data)
+{
+	page->data = data;
+}
@@ -0,0 +1,37 @@
+#ifndef HOST_H
+#define HOST_H
+
+#include <zathura/plugin-api.h>
+
+/**
+ * Creates a document like zathura would before calling document_open
+ *
+ * @param path Path of the .note file
+ * @return The document, free with host_document_free
+ */
+zathura_document_t *host_document_new(const char *path);
+
+/**
+ * Frees a document created with host_document_new (not its plugin data)
+ *
+ * @param document The document
+ */
+void host_document_free(zathura_document_t *document);
+
+/**
+ * Creates a page like zathura would before calling page_init
+ *
+ * @param document The document of the page
+ * @param index Index of the page
+ * @return The page, free with host_page_free
+ */
+zathura_page_t *host_page_new(zathura_document_t *document, unsigned int index);
+
+/**
+ * Frees a page created with host_page_new (not its plugin data)
+ *
+ * @param page The page
+ */
+void host_page_free(zathura_page_t *page);
+
+#endif
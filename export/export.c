@@ -0,0 +1,226 @@
+// Copyright (c) 2021 Marvin Borner
+
+// Exports .note documents without zathura: PDF pages are rendered like for printing
+// (vector strokes and text, original JPEGs embedded), PNG pages like on screen
+// Every document is exported in its own process, so many can be exported at once and
+// a broken one doesn't take the others down
+
+#include "../bench/host.h"
+
+#include "../zathura-note/plugin.h"
+
+#include <cairo-pdf.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+typedef enum { EXPORT_PDF, EXPORT_PNG } export_format_t;
+
+typedef struct {
+	export_format_t format;
+	double scale; // Of PNG pages
+	const char *output; // Directory, next to the input if 0
+} export_options_t;
+
+// Output path without extension: "dir/name.note" -> "output/name" or "dir/name"
+static char *export_base(const char *path, const export_options_t *options)
+{
+	const char *name = strrchr(path, '/');
+	name = name ? name + 1 : path;
+	size_t directory_length =
+		options->output ? strlen(options->output) + 1 : (size_t)(name - path);
+	size_t name_length = strlen(name);
+	if (name_length > 5 && !strcmp(name + name_length - 5, ".note"))
+		name_length -= 5;
+
+	char *base = malloc(directory_length + name_length + 1);
+	if (options->output)
+		sprintf(base, "%s/", options->output);
+	else
+		memcpy(base, path, directory_length);
+	memcpy(base + directory_length, name, name_length);
+	base[directory_length + name_length] = 0;
+	return base;
+}
+
+static int export_pdf(zathura_page_t **pages, unsigned int page_count, const char *base)
+{
+	char *name = malloc(strlen(base) + 5);
+	sprintf(name, "%s.pdf", base);
+
+	// Every page sets its own size
+	cairo_surface_t *surface = cairo_pdf_surface_create(name, 1, 1);
+	for (unsigned int i = 0; i < page_count; i++) {
+		cairo_pdf_surface_set_size(surface, zathura_page_get_width(pages[i]),
+					   zathura_page_get_height(pages[i]));
+		cairo_t *cairo = cairo_create(surface);
+		note_page_render_cairo(pages[i], zathura_page_get_data(pages[i]), cairo, true);
+		cairo_show_page(cairo);
+		cairo_destroy(cairo);
+	}
+	cairo_surface_finish(surface);
+
+	cairo_status_t status = cairo_surface_status(surface);
+	if (status != CAIRO_STATUS_SUCCESS)
+		fprintf(stderr, "Couldn't write %s: %s\n", name, cairo_status_to_string(status));
+	cairo_surface_destroy(surface);
+	free(name);
+	return status == CAIRO_STATUS_SUCCESS;
+}
+
+static int export_png(zathura_page_t **pages, unsigned int page_count, const char *base,
+		      double scale)
+{
+	char *name = malloc(strlen(base) + 16);
+	int ok = 1;
+	for (unsigned int i = 0; i < page_count && ok; i++) {
+		int width = zathura_page_get_width(pages[i]) * scale + 0.5;
+		int height = zathura_page_get_height(pages[i]) * scale + 0.5;
+		cairo_surface_t *surface =
+			cairo_image_surface_create(CAIRO_FORMAT_RGB24, width > 0 ? width : 1,
+						   height > 0 ? height : 1);
+		cairo_t *cairo = cairo_create(surface);
+		cairo_set_source_rgb(cairo, 1, 1, 1);
+		cairo_paint(cairo);
+		cairo_scale(cairo, scale, scale);
+		note_page_render_cairo(pages[i], zathura_page_get_data(pages[i]), cairo, false);
+		cairo_destroy(cairo);
+
+		sprintf(name, "%s-%04u.png", base, i);
+		cairo_status_t status = cairo_surface_write_to_png(surface, name);
+		if (status != CAIRO_STATUS_SUCCESS) {
+			fprintf(stderr, "Couldn't write %s: %s\n", name,
+				cairo_status_to_string(status));
+			ok = 0;
+		}
+		cairo_surface_destroy(surface);
+	}
+	free(name);
+	return ok;
+}
+
+// Returns 0 on failure
+static int export_document(const char *path, const export_options_t *options)
+{
+	zathura_document_t *document = host_document_new(path);
+	if (note_document_open(document) != ZATHURA_ERROR_OK) {
+		fprintf(stderr, "Couldn't open %s\n", path);
+		host_document_free(document);
+		return 0;
+	}
+
+	unsigned int page_count = zathura_document_get_number_of_pages(document);
+	zathura_page_t **pages = calloc(page_count, sizeof(*pages));
+	for (unsigned int i = 0; i < page_count; i++) {
+		pages[i] = host_page_new(document, i);
+		note_page_init(pages[i]);
+	}
+
+	char *base = export_base(path, options);
+	int ok = options->format == EXPORT_PDF ?
+			 export_pdf(pages, page_count, base) :
+			 export_png(pages, page_count, base, options->scale);
+	free(base);
+
+	for (unsigned int i = 0; i < page_count; i++) {
+		note_page_clear(pages[i], zathura_page_get_data(pages[i]));
+		host_page_free(pages[i]);
+	}
+	free(pages);
+	note_document_free(document, zathura_document_get_data(document));
+	host_document_free(document);
+	return ok;
+}
+
+// Waits for one child, returns 0 if it failed
+static int export_wait(void)
+{
+	int status;
+	if (wait(&status) < 0)
+		return 0;
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [--format pdf|png] [--scale S] [--jobs N] [--output DIR] FILE...\n"
+		"  --format F    pdf (default, one file per document) or png (one per page)\n"
+		"  --scale S     Scale of png pages (default 2)\n"
+		"  --jobs N      Documents exported at once (default: number of CPUs)\n"
+		"  --output DIR  Directory for the exports (default: next to every document)\n",
+		name);
+}
+
+int main(int argc, char *argv[])
+{
+	export_options_t options = { .format = EXPORT_PDF, .scale = 2 };
+	long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+
+	int i = 1;
+	for (; i < argc && argv[i][0] == '-'; i++) {
+		if (!strcmp(argv[i], "--format") && i + 1 < argc) {
+			i++;
+			if (!strcmp(argv[i], "pdf")) {
+				options.format = EXPORT_PDF;
+			} else if (!strcmp(argv[i], "png")) {
+				options.format = EXPORT_PNG;
+			} else {
+				usage(argv[0]);
+				return 1;
+			}
+		} else if (!strcmp(argv[i], "--scale") && i + 1 < argc) {
+			options.scale = strtod(argv[++i], NULL);
+		} else if (!strcmp(argv[i], "--jobs") && i + 1 < argc) {
+			jobs = atol(argv[++i]);
+		} else if (!strcmp(argv[i], "--output") && i + 1 < argc) {
+			options.output = argv[++i];
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (i >= argc || options.scale <= 0) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (jobs < 1)
+		jobs = 1;
+
+	// Exports are one-offs: No index cache files for every document and no previews,
+	// unless asked for explicitly
+	setenv("ZATHURA_NOTE_CACHE", "0", 0);
+	setenv("ZATHURA_NOTE_PREVIEW_SCALE", "0", 0);
+
+	int total = argc - i, failed = 0;
+	long running = 0;
+	for (; i < argc; i++) {
+		if (jobs == 1) {
+			failed += !export_document(argv[i], &options);
+			continue;
+		}
+
+		if (running == jobs) {
+			failed += !export_wait();
+			running--;
+		}
+
+		pid_t pid = fork();
+		if (pid < 0) { // Do it here then
+			failed += !export_document(argv[i], &options);
+		} else if (!pid) {
+			_exit(export_document(argv[i], &options) ? 0 : 1);
+		} else {
+			running++;
+		}
+	}
+	while (running--)
+		failed += !export_wait();
+
+	if (failed)
+		fprintf(stderr, "%d of %d documents failed\n", failed, total);
+	return failed ? 1 : 0;
+}
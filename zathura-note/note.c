@@ -1,447 +1,3834 @@
 // Copyright (c) 2021 Marvin Borner
 
-#include "plugin.h"
+#include "note.h"
 
-#include <plist/plist.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <zip.h>
 
 #include <jpeglib.h>
+#include <png.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+// Color and width shared by curves
+typedef struct {
+	char color[4]; // RGBA
+	float width;
+} note_stroke_style_t;
+
+// Rectangle in document coordinates
+typedef struct {
+	float x1, y1, x2, y2;
+} note_bounds_t;
+
+// Curves of the handwriting overlay, points are quantized, see note_strokes_encode
+typedef struct {
+	const signed char *points; // Interleaved x/y deltas
+	const unsigned int *offsets; // First byte of every curve in points
+	const note_bounds_t *bounds; // Of the points of every curve, empty if it has none
+	const unsigned int *num_points; // Number of points per curve
+	const unsigned int *styles; // Index into palette per curve
+	const note_stroke_style_t *palette;
+	size_t points_length, curves_length, palette_length; // Number of bytes/curves/styles
+	unsigned int max_points; // Of the longest curve
+} note_strokes_t;
+
+// Reference to a single curve in note_strokes_t
+typedef struct {
+	unsigned int curve; // Index of style and number of points
+	unsigned int offset; // Index of first byte in points
+} note_curve_ref_t;
+
+typedef enum { NOTE_OBJECT_IMAGE, NOTE_OBJECT_TEXT } note_object_type_t;
+
+// Media object (ImageMediaObject or TextBlockMediaObject) in drawing order
+typedef struct {
+	note_object_type_t type;
+	float x, y, width, height;
+	unsigned int path; // Image: relativePath in strings
+	char is_jpeg; // Image: 0 means png
+	int block; // Text: index in blocks or -1
+} note_object_t;
+
+// Sub range of a text block with resolved attributes
+typedef struct {
+	unsigned int start, end; // Byte range in the text of the block
+	unsigned int font; // Font name in strings
+	int font_size;
+	float red, green, blue, alpha;
+} note_text_run_t;
+
+// Text store (NBAttributedBackingString) with its sub ranges
+typedef struct {
+	unsigned int text, text_length; // In strings
+	unsigned int runs, runs_length; // In runs
+} note_text_block_t;
+
+// Flat render model compiled from the $objects graph at open time
+typedef struct {
+	note_object_t *objects;
+	note_text_block_t *blocks;
+	note_text_run_t *runs;
+	char *strings; // 0-terminated, referenced by offset
+	size_t objects_length, blocks_length, runs_length, strings_length;
+	int global_block; // Block of the global text store or -1
+
+	note_strokes_t strokes;
+} note_model_t;
+
+// LRU cache of decoded images, already scaled to the size they're drawn with
+typedef struct {
+	GMutex lock;
+	GHashTable *images; // Key -> link in lru
+	GQueue lru; // Of note_image_t, most recently used first
+	size_t size, budget; // In bytes
+} note_image_cache_t;
+
+// Character of the text on a page with its logical rectangle in page coordinates
+typedef struct {
+	float x1, y1, x2, y2;
+	unsigned int start, end; // Byte range in text
+} note_text_char_t;
+
+// Text of a page as it's drawn, for searching and extracting it, see note_page_text
+typedef struct {
+	char *text; // Of the runs on the page, one after the other
+	char *folded; // Case folded and normalized like queries
+	unsigned int *folded_chars; // Character each byte of folded belongs to
+	note_text_char_t *chars;
+	size_t text_length, folded_length, chars_length;
+} note_page_text_t;
+
+// Shaped text layouts, reused by every render until the font options change
+// Pango objects aren't thread-safe, only use them with lock held
+typedef struct {
+	GMutex lock;
+	PangoFontMap *font_map;
+	PangoContext *context;
+	cairo_font_options_t *font_options; // The layouts are shaped with
+	GHashTable *fonts; // "font/size" -> PangoFontDescription
+	PangoLayout **layouts; // Per run of the model
+	size_t layouts_length;
+	GQueue lru; // Runs with a layout, most recently used first
+	GList **links; // Per run, its link in lru
+	gint64 *used; // Per run, monotonic time of the last use of its layout
+	size_t size; // Estimated bytes of the layouts
+	note_page_text_t **pages; // Built on the first query of each page, made of the layouts
+	size_t pages_length;
+	const note_text_block_t *wrap_block; // Its layouts wrap at wrap_width, see note_text_wrap
+	float wrap_width;
+} note_text_cache_t;
+
+// Block of the arena, the allocations follow the (padded) header
+typedef struct note_arena_block {
+	struct note_arena_block *next;
+	size_t used, size;
+} note_arena_block_t;
+
+// Bump allocator for the model and index of a document, everything is freed at once
+typedef struct {
+	note_arena_block_t *blocks; // The one allocations are taken from first
+	size_t size; // Bytes handed out
+} note_arena_t;
+
+#define ARENA_BLOCK (1 << 20)
+#define ARENA_ALIGN 16
+
+// Entry of the .note zip
+typedef struct {
+	zip_uint64_t index; // In libzip
+	size_t size;
+	unsigned int crc; // 0 if unknown
+	off_t offset; // Of the data in the file if it's stored uncompressed, otherwise 0
+} note_archive_entry_t;
+
+// Reusable buffer for entries
+typedef struct {
+	void *data;
+	size_t capacity;
+} note_archive_buffer_t;
+
+// Number of buffers kept for reuse and the largest one that's kept
+#define ARCHIVE_POOL_BUFFERS 4
+#define ARCHIVE_POOL_RETAIN (8 << 20)
+
+// Reader of the .note zip: Entries are found by their path below the root directory and
+// read into pooled buffers, stored ones straight from the file and compressed ones
+// inflated by libzip
+typedef struct {
+	zip_t *zip; // libzip isn't thread-safe, only use with lock held
+	GMutex lock; // Also protects the pool
+	int fd; // Stored entries are read from, -1 if there are none
+	GHashTable *entries; // Path -> entry in entry_array
+	note_archive_entry_t *entry_array;
+	note_archive_buffer_t pool[ARCHIVE_POOL_BUFFERS];
+	int pool_length;
+} note_archive_t;
+
+// Contents of an entry, give it back with note_archive_release
+typedef struct {
+	const void *data;
+	size_t length;
+	note_archive_buffer_t buffer; // From the pool
+} note_blob_t;
+
+// Phases and counters of the instrumentation (ZATHURA_NOTE_PROFILE/ZATHURA_NOTE_TRACE)
+typedef enum {
+	NOTE_PHASE_OPEN,
+	NOTE_PHASE_CACHE_LOAD,
+	NOTE_PHASE_PLIST,
+	NOTE_PHASE_COMPILE, // All plist_access walks happen in here
+	NOTE_PHASE_RENDER,
+	NOTE_PHASE_PREPARE,
+	NOTE_PHASE_IMAGES,
+	NOTE_PHASE_ZIP,
+	NOTE_PHASE_DECODE,
+	NOTE_PHASE_SCALE,
+	NOTE_PHASE_TEXT,
+	NOTE_PHASE_LAYOUT,
+	NOTE_PHASE_STROKES,
+	NOTE_PHASE_PREFETCH,
+	NOTE_PHASE_REFLOW,
+	NOTE_PHASES
+} note_phase_t;
+
+typedef enum {
+	NOTE_COUNTER_BYTES_INFLATED,
+	NOTE_COUNTER_BYTES_STORED,
+	NOTE_COUNTER_IMAGES_DECODED,
+	NOTE_COUNTER_IMAGE_CACHE_HITS,
+	NOTE_COUNTER_LAYOUTS_CREATED,
+	NOTE_COUNTER_CURVES_EMITTED,
+	NOTE_COUNTER_CURVES_CULLED,
+	NOTE_COUNTER_POINTS_EMITTED,
+	NOTE_COUNTER_PREVIEWS,
+	NOTE_COUNTER_TILE_HITS,
+	NOTE_COUNTER_TILES_RENDERED,
+	NOTE_COUNTER_RUNS_REFLOWED,
+	NOTE_COUNTERS
+} note_counter_t;
+
+// A finished phase, written to the trace as a complete event
+typedef struct {
+	note_phase_t phase;
+	gint64 begin, duration; // Monotonic, in microseconds
+} note_trace_event_t;
+
+// Timings of one note_document_open/note_page_render_cairo call, or the sum of
+// all of them in the document
+typedef struct {
+	int enabled, tracing;
+	gint64 begin[NOTE_PHASES]; // Of the running phases
+	gint64 time[NOTE_PHASES];
+	unsigned long calls[NOTE_PHASES];
+	unsigned long counters[NOTE_COUNTERS];
+	note_trace_event_t *events;
+	size_t events_length, events_capacity;
+} note_profile_t;
 
 // Data struct for entire document
 typedef struct {
-	zip_t *zip;
-	plist_t objects;
-	char *root_name;
+	note_archive_t archive;
+	// Model and index (unless they're in cache_map), only grown while opening and with
+	// index_lock held
+	note_arena_t arena;
+	int compiled; // The model was compiled from Session.plist
 	double width, height; // Page size is constant
+	int page_count;
+	// Reflowable documents are laid out at this width (ZATHURA_NOTE_REFLOW_WIDTH) and
+	// their global text store wraps at it, see note_document_reflow
+	double reflow_width;
+	int reflowable;
+
+	note_model_t model;
+	// Per-page stroke index: page i draws curve_refs[page_curves[i]..page_curves[i + 1]]
+	// in drawing order
+	note_curve_ref_t *curve_refs;
+	unsigned int *page_curves;
+	// Per-page object index: page i draws objects object_refs[page_objects[i]..
+	// page_objects[i + 1]] of the model in drawing order
+	unsigned int *object_refs;
+	unsigned int *page_objects;
+	// Position of every run of the global text store and the running maximum of
+	// their ends, so a page can find its runs by binary search
+	float *run_y, *run_max_end;
+	// Per run of the global text store of reflowable documents, its number of lines
+	// after wrapping and its widest line without
+	unsigned int *run_lines;
+	float *run_widths;
+	// Simplified curves of level l > 0: curve c keeps the points
+	// lod_points[lod_offsets[(l - 1) * (curves + 1) + c]..] (indices into the curve)
+	unsigned int *lod_offsets;
+	unsigned int *lod_points;
+	GMutex index_lock; // The index is built lazily while rendering
+
+	// Session.plist is all the model and index are made of, its CRC (0 if unknown) and
+	// size identify them
+	unsigned int session_crc;
+	size_t session_size;
+
+	// On-disk index cache, model and index point into cache_map if it was loaded
+	char *cache_path;
+	void *cache_map;
+	size_t cache_map_length;
+	unsigned int cache_built; // Parts of the index the loaded cache has, see note_cache_built
+
+	note_image_cache_t images;
+	note_image_cache_t tiles; // Stroke layers, see note_page_render_stroke_tiles
+	note_text_cache_t texts;
+	size_t memory_budget; // Of everything above, see note_document_fit_budget
+	gint memory_warned; // The model and index alone exceeded the budget
+	double preview_scale;
+
+	// Background work for the pages around the rendered one, see note_document_prefetch
+	GThreadPool *prefetch_pool; // Created on the first render
+	GMutex prefetch_lock;
+	int prefetch_pages; // Before and after the rendered page
+	gint prefetch_center; // Last rendered page, jobs too far away from it are stale
+	gint prefetch_closing;
+	// Per page, scale it's prefetched at (0 if not queued, or if that was dropped since)
+	double *prefetch_scales;
+
+	// Instrumentation, calls merge their own profile into this one when they're done
+	note_profile_t profile;
+	GMutex profile_lock;
+	FILE *trace; // Chrome trace event JSON
 } note_document_t;
 
-// Data struct for single page
+// Data struct for single page, immutable after note_page_init
 typedef struct {
 	double start, end;
-	cairo_t *cairo;
+	int number;
 	zathura_page_t *page;
 } note_page_t;
 
+// State of a single note_page_render_cairo call
+typedef struct {
+	note_document_t *document;
+	const note_page_t *page;
+	cairo_t *cairo;
+	note_bounds_t clip; // Visible part of the page in document coordinates
+	int lod; // Level of detail of curves
+	int smooth; // Whether raw curves are drawn as bezier curves
+	int preview; // Fast and rough, see note_page_render_preview
+	int printing; // Full detail and original images for vector surfaces
+	note_profile_t *profile;
+} note_render_t;
+
 // Found by reverse engineering
 #define SESSION_OBJECTS_GENERAL_INFO 1
 #define SESSION_OBJECTS_GLOBAL_TEXT_STORE 2
 
+// Stroke levels of detail, level 0 is the raw curve
+#define LOD_LEVELS 4
+// Curve points are kept in fixed point with this many steps per document unit
+#define POINT_SCALE 16
+// Marks a point delta that doesn't fit into a byte, the delta follows as int32_t
+#define POINT_ESCAPE -128
+// Coarsest level whose tolerance stays below this many device pixels is drawn
+#define LOD_PIXEL_TOLERANCE 0.5
+// Raw curves are drawn as smooth bezier curves above this many pixels per unit
+#define BEZIER_SCALE 2
+
+// Upper bound of Pango's line height relative to the font size
+#define TEXT_LINE_HEIGHT 1.5
+// Estimated memory of a shaped layout and per byte of its text
+#define LAYOUT_SIZE 2048
+#define LAYOUT_SIZE_PER_BYTE 64
+
+// Default memory budget of the image cache in MiB (ZATHURA_NOTE_IMAGE_CACHE)
+#define IMAGE_CACHE_BUDGET 64
+// Default memory budget of the stroke tile cache in MiB (ZATHURA_NOTE_TILE_CACHE), the
+// side of its tiles in device pixels
+#define TILE_CACHE_BUDGET 32
+#define TILE_SIZE 256
+// Estimated bytes every cached image costs besides its pixels (entry, key, surface, hash
+// node), so empty tiles don't pile up for free
+#define IMAGE_ENTRY_SIZE 256
+// Longer side of the image thumbnails previews use, in pixels
+#define IMAGE_THUMBNAIL_SIZE 128
+// Default budget in MiB of the model, index and all caches together (ZATHURA_NOTE_MEMORY)
+#define MEMORY_BUDGET 256
+// The caches always get at least this share of the budget, even if the model and index
+// take all of it, or every redraw would decode its images again
+#define MEMORY_BUDGET_CACHE_SHARE 4
+
+// Scale below which pages are rendered as previews (ZATHURA_NOTE_PREVIEW_SCALE)
+#define PREVIEW_SCALE 0.25
+
+// Default width reflowable documents are laid out with (ZATHURA_NOTE_REFLOW_WIDTH)
+#define REFLOW_WIDTH 500
+
+// Pages before and after the rendered one that are prepared in the background
+// (ZATHURA_NOTE_PREFETCH) and the number of threads doing that
+#define PREFETCH_PAGES 2
+#define PREFETCH_THREADS 2
+
 /**
- * Zip wrappers/utilities
+ * Configuration
  */
 
-static void zip_load(zip_t *zip, const char *root_name, const char *path, void **buf,
-		     size_t *length)
+// Reads a size in MiB from the environment
+static size_t env_mebibytes(const char *name, size_t fallback)
 {
-	char name[1024] = { 0 };
-	snprintf(name, sizeof(name), "%s/%s", root_name, path);
-	zip_stat_t stat;
-	zip_stat(zip, name, 0, &stat);
-	zip_file_t *file = zip_fopen(zip, name, 0);
-	if (!file) {
-		zip_error_t *err = zip_get_error(zip);
-		fprintf(stderr, "Couldn't find '%s' in zip: %s\n", name, zip_error_strerror(err));
-		*buf = 0;
-		*length = 0;
-		return;
+	const char *value = g_getenv(name);
+	if (!value || !*value)
+		return fallback << 20;
+
+	char *end;
+	unsigned long mebibytes = strtoul(value, &end, 10);
+	if (*end) {
+		fprintf(stderr, "Invalid value '%s' for %s, using %lu\n", value, name, fallback);
+		return fallback << 20;
 	}
 
-	*buf = malloc(stat.size);
-	*length = zip_fread(file, *buf, stat.size);
-	if (*length < stat.size) {
-		fprintf(stderr, "Unexpected size difference\n");
-		free(*buf);
-		*buf = 0;
-		*length = 0;
-		return;
+	return (size_t)mebibytes << 20;
+}
+
+static double env_number(const char *name, double fallback)
+{
+	const char *value = g_getenv(name);
+	if (!value || !*value)
+		return fallback;
+
+	char *end;
+	double number = strtod(value, &end);
+	if (*end) {
+		fprintf(stderr, "Invalid value '%s' for %s, using %g\n", value, name, fallback);
+		return fallback;
 	}
+
+	return number;
+}
+
+// Whether an environment variable is set to something other than 0
+static int env_flag_default(const char *name, int fallback)
+{
+	const char *value = g_getenv(name);
+	if (!value || !*value)
+		return fallback;
+	return strcmp(value, "0") != 0;
+}
+
+static int env_flag(const char *name)
+{
+	return env_flag_default(name, 0);
 }
 
 /**
- * Plist wrappers/utilities
+ * Instrumentation
  */
 
-// For debugging/reverse engineering
-#define INDENT 4
-static void plist_dump(plist_t plist, int depth)
+static const char *note_phase_names[NOTE_PHASES] = {
+	"open", "cache load", "plist", "compile", "render",  "prepare", "images",
+	"zip",	"decode",     "scale", "text",	  "layout", "strokes", "prefetch",
+	"reflow",
+};
+
+static const char *note_counter_names[NOTE_COUNTERS] = {
+	"bytes inflated", "bytes stored",   "images decoded", "image cache hits",
+	"layouts created", "curves emitted", "curves culled",  "points emitted",
+	"previews",        "tile hits",      "tiles rendered", "runs reflowed",
+};
+
+// Starts the profile of a single call with the switches of the document's profile
+static void note_profile_init(note_profile_t *profile, const note_profile_t *document_profile)
 {
-	for (int i = 0; i < depth * INDENT; i++)
-		printf(" ");
+	memset(profile, 0, sizeof(*profile));
+	profile->enabled = document_profile->enabled;
+	profile->tracing = document_profile->tracing;
+}
 
-	if (PLIST_IS_BOOLEAN(plist)) {
-		unsigned char val;
-		plist_get_bool_val(plist, &val);
-		printf("<bool>%s</bool>\n", val ? "true" : "false");
-	} else if (PLIST_IS_UINT(plist)) {
-		size_t val;
-		plist_get_uint_val(plist, &val);
-		printf("<uint>%lu</uint>\n", val);
-	} else if (PLIST_IS_REAL(plist)) {
-		double val;
-		plist_get_real_val(plist, &val);
-		printf("<real>%f</real>\n", val);
-	} else if (PLIST_IS_STRING(plist)) {
-		char *val;
-		plist_get_string_val(plist, &val);
-		printf("<string>%s</string>\n", val);
-		free(val);
-	} else if (PLIST_IS_ARRAY(plist)) {
-		plist_array_iter iter;
-		plist_array_new_iter(plist, &iter);
-		printf("<array>\n");
-		int id = 0;
-		while (1) {
-			plist_t val;
-			plist_array_next_item(plist, iter, &val);
-			if (!val)
-				break;
+static void note_profile_begin(note_profile_t *profile, note_phase_t phase)
+{
+	if (profile->enabled)
+		profile->begin[phase] = g_get_monotonic_time();
+}
 
-			for (int i = 0; i < (depth + 1) * INDENT; i++)
-				printf(" ");
-			printf("<array_item id=\"%d\">\n", id++);
+static void note_profile_end(note_profile_t *profile, note_phase_t phase)
+{
+	if (!profile->enabled)
+		return;
 
-			plist_dump(val, depth + 2);
+	gint64 duration = g_get_monotonic_time() - profile->begin[phase];
+	profile->time[phase] += duration;
+	profile->calls[phase]++;
 
-			for (int i = 0; i < (depth + 1) * INDENT; i++)
-				printf(" ");
-			printf("</array_item>\n");
-		}
-		for (int i = 0; i < depth * INDENT; i++)
-			printf(" ");
-		printf("</array>\n");
-	} else if (PLIST_IS_DICT(plist)) {
-		plist_dict_iter iter;
-		plist_dict_new_iter(plist, &iter);
-		char *key = 0;
-		plist_t val;
-		printf("<dict>\n");
-		int id = 0;
-		while (1) {
-			plist_dict_next_item(plist, iter, &key, &val);
-			if (!key || !val)
-				break;
+	if (!profile->tracing)
+		return;
 
-			for (int i = 0; i < (depth + 1) * INDENT; i++)
-				printf(" ");
-			printf("<dict_item key=\"%s\" id=\"%d\">\n", key, id++);
+	if (profile->events_length == profile->events_capacity) {
+		size_t capacity = profile->events_capacity;
+		profile->events_capacity = capacity ? capacity * 2 : 64;
+		profile->events = realloc(profile->events,
+					  profile->events_capacity * sizeof(*profile->events));
+	}
+	profile->events[profile->events_length++] =
+		(note_trace_event_t){ phase, profile->begin[phase], duration };
+}
+
+static void note_profile_count(note_profile_t *profile, note_counter_t counter,
+			       unsigned long count)
+{
+	profile->counters[counter] += count;
+}
 
-			plist_dump(val, depth + 2);
-			free(key);
+// Adds a finished call to the document's totals and writes its trace events
+static void note_profile_merge(note_document_t *note_document, note_profile_t *profile, int page)
+{
+	if (!profile->enabled)
+		return;
 
-			for (int i = 0; i < (depth + 1) * INDENT; i++)
-				printf(" ");
-			printf("</dict_item>\n");
+	note_profile_t *total = &note_document->profile;
+	g_mutex_lock(&note_document->profile_lock);
+	for (int i = 0; i < NOTE_PHASES; i++) {
+		total->time[i] += profile->time[i];
+		total->calls[i] += profile->calls[i];
+	}
+	for (int i = 0; i < NOTE_COUNTERS; i++)
+		total->counters[i] += profile->counters[i];
+
+	FILE *trace = note_document->trace;
+	if (trace && profile->events_length) {
+		int pid = getpid();
+		unsigned int tid = GPOINTER_TO_UINT(g_thread_self());
+		gint64 end = 0;
+		for (size_t i = 0; i < profile->events_length; i++) {
+			const note_trace_event_t *event = &profile->events[i];
+			fprintf(trace,
+				"{\"name\":\"%s\",\"cat\":\"note\",\"ph\":\"X\",\"ts\":%lld,"
+				"\"dur\":%lld,\"pid\":%d,\"tid\":%u,\"args\":{\"page\":%d}},\n",
+				note_phase_names[event->phase], (long long)event->begin,
+				(long long)event->duration, pid, tid, page);
+			if (event->begin + event->duration > end)
+				end = event->begin + event->duration;
 		}
-		for (int i = 0; i < depth * INDENT; i++)
-			printf(" ");
-		printf("</dict>\n");
-	} else if (PLIST_IS_DATE(plist)) {
-		int sec, usec;
-		plist_get_date_val(plist, &sec, &usec);
-		printf("<date>%d</date>\n", sec); // Since 01/01/2001
-	} else if (PLIST_IS_DATA(plist)) {
-		size_t length;
-		const char *val = plist_get_data_ptr(plist, &length);
-		(void)val;
-		printf("<data length=\"%lu\">...</data>\n", length);
-	} else if (PLIST_IS_KEY(plist)) {
-		char *val;
-		plist_get_key_val(plist, &val);
-		printf("<key>%s</key>\n", val);
-		free(val);
-	} else if (PLIST_IS_UID(plist)) {
-		size_t val;
-		plist_get_uid_val(plist, &val);
-		printf("<uid>%lu</uid>\n", val);
+
+		fprintf(trace,
+			"{\"name\":\"counters\",\"ph\":\"C\",\"ts\":%lld,\"pid\":%d,\"args\":{",
+			(long long)end, pid);
+		for (int i = 0; i < NOTE_COUNTERS; i++)
+			fprintf(trace, "%s\"%s\":%lu", i ? "," : "", note_counter_names[i],
+				profile->counters[i]);
+		fprintf(trace, "}},\n");
 	}
+	g_mutex_unlock(&note_document->profile_lock);
+
+	free(profile->events);
+	profile->events = 0;
+	profile->events_length = profile->events_capacity = 0;
 }
 
-static zathura_error_t plist_load(zip_t *zip, plist_t *plist, const char *root_name,
-				  const char *path)
+// Enables the instrumentation if requested, before anything of the document is loaded
+static void note_profile_open(note_document_t *note_document)
 {
-	void *bin;
-	size_t length;
-	zip_load(zip, root_name, path, &bin, &length);
+	g_mutex_init(&note_document->profile_lock);
+	note_profile_t *profile = &note_document->profile;
+	profile->enabled = env_flag("ZATHURA_NOTE_PROFILE");
 
-	if (!bin || !length || !plist_is_binary(bin, length)) {
-		fprintf(stderr, "Unexpected file format of '%s'\n", path);
-		free(bin);
-		return ZATHURA_ERROR_INVALID_ARGUMENTS;
+	const char *trace = g_getenv("ZATHURA_NOTE_TRACE");
+	if (!trace || !*trace)
+		return;
+
+	note_document->trace = fopen(trace, "w");
+	if (!note_document->trace) {
+		fprintf(stderr, "Couldn't open trace file '%s'\n", trace);
+		return;
 	}
+	fprintf(note_document->trace, "{\"traceEvents\":[\n");
+	profile->enabled = 1;
+	profile->tracing = 1;
+}
 
-	plist_from_bin(bin, length, plist);
-	free(bin);
-	return ZATHURA_ERROR_OK;
+// Dumps the summary and finishes the trace
+static void note_profile_close(note_document_t *note_document, const char *path)
+{
+	const note_profile_t *profile = &note_document->profile;
+	if (profile->enabled) {
+		fprintf(stderr, "zathura-note profile of '%s' (%lu renders)\n", path,
+			profile->calls[NOTE_PHASE_RENDER]);
+		fprintf(stderr, "  %-12s %8s %12s %12s\n", "phase", "calls", "total ms", "mean ms");
+		for (int i = 0; i < NOTE_PHASES; i++) {
+			if (!profile->calls[i])
+				continue;
+			double time = profile->time[i] / 1e3;
+			fprintf(stderr, "  %-12s %8lu %12.3f %12.3f\n", note_phase_names[i],
+				profile->calls[i], time, time / profile->calls[i]);
+		}
+		for (int i = 0; i < NOTE_COUNTERS; i++)
+			fprintf(stderr, "  %-20s %lu\n", note_counter_names[i],
+				profile->counters[i]);
+	}
+
+	if (note_document->trace) {
+		// Metadata event last, so no event has to know whether it's the final one
+		fprintf(note_document->trace,
+			"{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+			"\"args\":{\"name\":\"zathura-note\"}}\n]}\n",
+			getpid());
+		fclose(note_document->trace);
+	}
+	g_mutex_clear(&note_document->profile_lock);
+}
+
+/**
+ * Zip wrappers/utilities
+ */
+
+static unsigned int zip_read16(const unsigned char *data)
+{
+	return data[0] | data[1] << 8;
 }
 
-static const void *plist_dict_get_data(plist_t node, const char *name, size_t *length)
+static unsigned long zip_read32(const unsigned char *data)
 {
-	plist_t data = plist_dict_get_item(node, name);
-	if (!PLIST_IS_DATA(data))
-		return 0;
-	return plist_get_data_ptr(data, length);
+	return data[0] | data[1] << 8 | data[2] << 16 | (unsigned long)data[3] << 24;
 }
 
-// Magic unicorn function to reduce ugliness of plist
-static plist_t plist_access(plist_t plist, int length, ...)
+// Reads exactly length bytes at offset. A file that got shorter fails instead of faulting
+// like a map of it would
+static int note_archive_pread(int fd, void *buffer, size_t length, off_t offset)
 {
-	if (!PLIST_IS_ARRAY(plist)) {
-		fprintf(stderr, "Only main $objects array is supported\n");
-		return 0;
+	for (size_t done = 0; done < length;) {
+		ssize_t result = pread(fd, (char *)buffer + done, length - done, offset + done);
+		if (result < 0 && errno == EINTR)
+			continue;
+		if (result <= 0)
+			return 0;
+		done += result;
 	}
+	return 1;
+}
 
-	va_list va;
-	va_start(va, length);
-
-	unsigned long uid = 0;
-	const char **ptr, *dict_key;
-	plist_t current = plist;
-	int i, array_index;
-	for (i = 0; i < length && current; i++) {
-		plist_type type = plist_get_node_type(current);
-		switch (type) {
-		case PLIST_ARRAY:
-			array_index = va_arg(va, int);
-			current = plist_array_get_item(current, array_index);
-			if (!current)
-				fprintf(stderr, "Couldn't find %d in array\n", array_index);
-			break;
-		case PLIST_DICT:
-			dict_key = va_arg(va, const char *);
-			current = plist_dict_get_item(current, dict_key);
-			if (!current)
-				fprintf(stderr, "Couldn't find '%s' in dict\n", dict_key);
-			break;
-		case PLIST_UID: // Automatic tracing!
-			plist_get_uid_val(current, &uid);
-			current = plist_array_get_item(plist, uid);
-			i--; // UID doesn't count
-			break;
-		case PLIST_DATA:
-			if (i + 2 < length)
-				fprintf(stderr, "Unexpected data\n");
-			ptr = va_arg(va, const char **);
-			*ptr = plist_get_data_ptr(current, va_arg(va, unsigned long *));
-			goto end;
-		case PLIST_STRING:
-			if (i + 2 < length)
-				fprintf(stderr, "Unexpected string\n");
-			ptr = va_arg(va, const char **);
-			*ptr = plist_get_string_ptr(current, va_arg(va, unsigned long *));
-			goto end;
-		case PLIST_BOOLEAN:
-			if (i + 1 < length)
-				fprintf(stderr, "Unexpected bool\n");
-			plist_get_bool_val(current, va_arg(va, unsigned char *));
-			goto end;
-		case PLIST_UINT:
-			if (i + 1 < length)
-				fprintf(stderr, "Unexpected uint\n");
-			plist_get_uint_val(current, va_arg(va, unsigned long *));
-			goto end;
-		case PLIST_REAL:
-			if (i + 1 < length)
-				fprintf(stderr, "Unexpected real\n");
-			plist_get_real_val(current, va_arg(va, double *));
+// Finds the data of every stored entry in the file of length bytes by walking the central
+// directory. libzip has no API for offsets, entries that don't match what libzip says are
+// skipped
+static void note_archive_find_stored(note_archive_t *archive, zip_uint64_t count,
+				     size_t length)
+{
+	// End of central directory record, possibly followed by a comment
+	if (length < 22)
+		return;
+	size_t tail_length = length < 0xffff + 22 ? length : 0xffff + 22;
+	size_t tail_start = length - tail_length;
+	unsigned char *tail = malloc(tail_length), *directory = 0;
+	if (!note_archive_pread(archive->fd, tail, tail_length, tail_start))
+		goto end;
+
+	size_t record = tail_length - 22;
+	while (zip_read32(&tail[record]) != 0x06054b50) {
+		if (!record)
 			goto end;
-		default:
-			fprintf(stderr, "Unknown plist type in access loop\n");
-		}
+		record--;
 	}
 
-	if (i != length)
-		fprintf(stderr, "Unexptected end of access loop\n");
+	size_t record_offset = tail_start + record;
+	size_t directory_offset = zip_read32(&tail[record + 16]);
+	size_t directory_length = zip_read32(&tail[record + 12]);
+	if (zip_read16(&tail[record + 10]) != count || directory_offset >= record_offset ||
+	    directory_length > record_offset - directory_offset)
+		goto end; // Zip64 or multi-disk, libzip handles these
+
+	directory = malloc(directory_length + 1);
+	if (!note_archive_pread(archive->fd, directory, directory_length, directory_offset))
+		goto end;
+
+	size_t position = 0;
+	for (zip_uint64_t i = 0; i < count; i++) {
+		if (position + 46 > directory_length ||
+		    zip_read32(&directory[position]) != 0x02014b50)
+			break;
 
-end:
-	// Resolve current if UID
-	if (PLIST_IS_UID(current)) {
-		plist_get_uid_val(current, &uid);
-		current = plist_array_get_item(plist, uid);
-	}
+		const unsigned char *header = &directory[position];
+		unsigned int flags = zip_read16(&header[8]), method = zip_read16(&header[10]);
+		unsigned long compressed = zip_read32(&header[20]), size = zip_read32(&header[24]);
+		unsigned int name_length = zip_read16(&header[28]);
+		size_t local = zip_read32(&header[42]);
+		position += 46 + name_length + zip_read16(&header[30]) + zip_read16(&header[32]);
+		if (position > directory_length)
+			break;
 
-	va_end(va);
+		note_archive_entry_t *entry = &archive->entry_array[i];
+		unsigned char local_header[30];
+		if (method != ZIP_CM_STORE || flags & 1 || compressed != size ||
+		    size != entry->size || !size || local + 30 > length ||
+		    !note_archive_pread(archive->fd, local_header, 30, local) ||
+		    zip_read32(local_header) != 0x04034b50)
+			continue;
 
-	// TODO: Exit entire zathura in these conditions? Hmmm
-	if (!current)
-		fprintf(stderr, "Fatal failure in access loop\n");
+		const char *name = zip_get_name(archive->zip, i, ZIP_FL_ENC_RAW);
+		if (!name || strlen(name) != name_length || memcmp(name, &header[46], name_length))
+			continue;
 
-	return current;
+		size_t data = local + 30;
+		data += zip_read16(&local_header[26]) + zip_read16(&local_header[28]);
+		if (data + size > length)
+			continue;
+		entry->offset = data;
+	}
+
+end:
+	free(directory);
+	free(tail);
 }
 
-static plist_t plist_handwriting_overlay(plist_t objects)
+// Indexes the entries below root_name once, so reads skip libzip's name lookup
+static void note_archive_open(note_archive_t *archive, zip_t *zip, const char *path,
+			      const char *root_name)
 {
-	plist_t overlay = plist_access(objects, 3, SESSION_OBJECTS_GLOBAL_TEXT_STORE,
-				       "Handwriting Overlay", "SpatialHash");
+	memset(archive, 0, sizeof(*archive));
+	archive->zip = zip;
+	archive->fd = -1;
+	g_mutex_init(&archive->lock);
+	archive->entries = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, 0);
+
+	zip_int64_t count = zip_get_num_entries(zip, 0);
+	if (count <= 0)
+		return;
+	archive->entry_array = calloc(count, sizeof(*archive->entry_array));
+
+	size_t root_length = strlen(root_name);
+	int stored = 0;
+	for (zip_int64_t i = 0; i < count; i++) {
+		zip_stat_t stat;
+		if (zip_stat_index(zip, i, 0, &stat) || !(stat.valid & ZIP_STAT_NAME) ||
+		    strncmp(stat.name, root_name, root_length) || stat.name[root_length] != '/')
+			continue;
 
-	if (!PLIST_IS_DICT(overlay)) {
-		fprintf(stderr, "Invalid handwriting overlay\n");
-		return 0;
+		note_archive_entry_t *entry = &archive->entry_array[i];
+		entry->index = i;
+		entry->size = stat.size;
+		entry->crc = stat.valid & ZIP_STAT_CRC ? stat.crc : 0;
+		stored |= stat.comp_method == ZIP_CM_STORE && stat.size;
+		g_hash_table_insert(archive->entries, g_strdup(stat.name + root_length + 1),
+				    entry);
 	}
 
-	return overlay;
+	// Most entries are compressed, reading past libzip is only worth it for stored ones
+	archive->fd = stored ? open(path, O_RDONLY) : -1;
+	if (archive->fd < 0)
+		return;
+
+	struct stat file_stat;
+	if (!fstat(archive->fd, &file_stat) && file_stat.st_size > 0)
+		note_archive_find_stored(archive, count, file_stat.st_size);
 }
 
-// Converts the strange "{42.123, 69.123}" format to respective floats
-static void plist_string_to_floats(const char *string, float *a, float *b)
+static const note_archive_entry_t *note_archive_entry(note_archive_t *archive, const char *path)
 {
-	char *end;
-	*a = strtof(string + 1, &end);
-	*b = strtof(end + 2, NULL);
+	return g_hash_table_lookup(archive->entries, path);
 }
 
-// TODO: Find more elegant solution for page count (there doesn't seem to be)
-static int plist_page_count(plist_t objects, double page_height)
+// Returns the buffer of the blob to the pool
+static void note_archive_release(note_archive_t *archive, note_blob_t *blob)
 {
-	const float *curves = 0;
-	size_t curves_length = 0;
-	plist_access(objects, 6, SESSION_OBJECTS_GLOBAL_TEXT_STORE, "Handwriting Overlay",
-		     "SpatialHash", "curvespoints", &curves, &curves_length);
-
-	// Find highest y curve-point
-	double max = 0;
-	for (size_t i = 0; i < curves_length / sizeof(*curves); i += 2)
-		if (curves[i + 1] > max)
-			max = curves[i + 1];
+	note_archive_buffer_t buffer = blob->buffer;
+	memset(blob, 0, sizeof(*blob));
+	if (!buffer.data)
+		return;
 
-	return (int)(max / page_height) + 1;
+	g_mutex_lock(&archive->lock);
+	if (archive->pool_length < ARCHIVE_POOL_BUFFERS && buffer.capacity <= ARCHIVE_POOL_RETAIN) {
+		archive->pool[archive->pool_length++] = buffer;
+		buffer.data = 0;
+	}
+	g_mutex_unlock(&archive->lock);
+	free(buffer.data);
 }
 
-static float plist_page_ratio(plist_t objects)
+// Returns 0 if the entry doesn't exist or couldn't be read
+static int note_archive_read(note_archive_t *archive, const char *path, note_blob_t *blob,
+			     note_profile_t *profile)
 {
-	float ratio = 1.414; // Default is DIN ratio because why not
+	memset(blob, 0, sizeof(*blob));
 
-	const char *type;
-	size_t type_length = 0;
-	plist_access(objects, 6, SESSION_OBJECTS_GENERAL_INFO,
-		     "NBNoteTakingSessionDocumentPaperLayoutModelKey", "documentPaperAttributes",
-		     "paperIdentifier", &type, &type_length);
+	const note_archive_entry_t *entry = note_archive_entry(archive, path);
+	if (!entry || !entry->size) {
+		fprintf(stderr, "Couldn't find '%s' in zip\n", path);
+		return 0;
+	}
 
-	if (!memcmp(type, "Legacy:13", type_length))
-		ratio = 1.3; // Or does 13 refer to 13x19"??
-	else if (!memcmp(type, "Legacy:0", type_length))
-		// 0 means page not renderable (?)
-		fprintf(stderr, "Page identifies as not renderable, please report\n");
-	else
-		fprintf(stderr, "Unknown paper identifier, please report: %s\n", type);
+	g_mutex_lock(&archive->lock);
+	note_profile_begin(profile, NOTE_PHASE_ZIP);
 
-	return ratio;
-}
+	// Smallest pooled buffer that fits, otherwise the largest one (grown below)
+	int best = -1;
+	for (int i = 0; i < archive->pool_length; i++) {
+		if (best < 0) {
+			best = i;
+			continue;
+		}
+		size_t capacity = archive->pool[i].capacity;
+		size_t best_capacity = archive->pool[best].capacity;
+		int fits = capacity >= entry->size, best_fits = best_capacity >= entry->size;
+		if (fits ? !best_fits || capacity < best_capacity
+			 : !best_fits && capacity > best_capacity)
+			best = i;
+	}
+	if (best >= 0) {
+		blob->buffer = archive->pool[best];
+		archive->pool[best] = archive->pool[--archive->pool_length];
+	}
+	if (blob->buffer.capacity < entry->size) {
+		free(blob->buffer.data);
+		blob->buffer.data = malloc(entry->size);
+		blob->buffer.capacity = entry->size;
+	}
 
-static float plist_page_width(plist_t objects)
-{
-	const char *class = 0;
-	size_t class_length = 0;
-	plist_access(objects, 6, SESSION_OBJECTS_GLOBAL_TEXT_STORE, "reflowState", "$class",
-		     "$classname", &class, &class_length);
+	// Stored entries don't need libzip or its lock, pread doesn't move the file offset
+	if (entry->offset) {
+		g_mutex_unlock(&archive->lock);
+		int read = note_archive_pread(archive->fd, blob->buffer.data, entry->size,
+					      entry->offset);
+		note_profile_end(profile, NOTE_PHASE_ZIP);
+		if (!read) {
+			fprintf(stderr, "Couldn't read '%s', did the file change?\n", path);
+			note_archive_release(archive, blob);
+			return 0;
+		}
 
-	double val = 500; // Default width if something fails or it's not specified
+		note_profile_count(profile, NOTE_COUNTER_BYTES_STORED, entry->size);
+		blob->data = blob->buffer.data;
+		blob->length = entry->size;
+		return 1;
+	}
 
-	if (!memcmp(class, "NBReflowStateReflowable", class_length)) {
-		fprintf(stderr,
-			"Warning: The global text store is reflowable, which isn't really supported right now. You can lock the reflow state by drawing some lines onto the document (I think)\n");
-	} else if (!memcmp(class, "NBReflowStateLocked", class_length)) { // That's how I like it
-		plist_access(objects, 4, SESSION_OBJECTS_GLOBAL_TEXT_STORE, "reflowState",
-			     "pageWidthInDocumentCoordsKey", &val);
+	zip_int64_t length = -1;
+	zip_file_t *file = zip_fopen_index(archive->zip, entry->index, 0);
+	if (file) {
+		length = zip_fread(file, blob->buffer.data, entry->size);
+		zip_fclose(file);
 	} else {
-		fprintf(stderr, "Unknown reflow state '%s', please report\n", class);
+		zip_error_t *err = zip_get_error(archive->zip);
+		fprintf(stderr, "Couldn't open '%s' in zip: %s\n", path, zip_error_strerror(err));
 	}
 
-	return val;
-}
+	note_profile_end(profile, NOTE_PHASE_ZIP);
+	g_mutex_unlock(&archive->lock);
 
-/**
- * Cairo wrappers/utilities
- */
+	if (length < (zip_int64_t)entry->size) {
+		if (file)
+			fprintf(stderr, "Unexpected size difference\n");
+		note_archive_release(archive, blob);
+		return 0;
+	}
 
-typedef struct {
-	char *data;
-	size_t length;
-} cairo_read_closure;
+	note_profile_count(profile, NOTE_COUNTER_BYTES_INFLATED, length);
+	blob->data = blob->buffer.data;
+	blob->length = length;
+	return 1;
+}
 
-// Cairo is weird. Why can't we just pass a data buffer directly?
+// Frees the pooled buffers, like the one Session.plist was inflated into
+static void note_archive_trim(note_archive_t *archive)
+{
+	g_mutex_lock(&archive->lock);
+	for (int i = 0; i < archive->pool_length; i++)
+		free(archive->pool[i].data);
+	archive->pool_length = 0;
+	g_mutex_unlock(&archive->lock);
+}
+
+static void note_archive_close(note_archive_t *archive)
+{
+	note_archive_trim(archive);
+	g_hash_table_destroy(archive->entries);
+	free(archive->entry_array);
+	if (archive->fd >= 0)
+		close(archive->fd);
+	zip_close(archive->zip);
+	g_mutex_clear(&archive->lock);
+}
+
+/**
+ * Plist wrappers/utilities
+ */
+
+// Session.plist is a binary plist ("bplist00"). Its objects are only decoded when
+// they're accessed, using the offset table at the end of the file, so opening doesn't
+// have to build a tree of the whole document first
+
+// Object by its number in the offset table plus one, 0 means none
+typedef uint64_t plist_ref_t;
+
+typedef enum {
+	PLIST_NONE,
+	PLIST_BOOLEAN,
+	PLIST_UINT,
+	PLIST_REAL,
+	PLIST_DATE,
+	PLIST_DATA,
+	PLIST_STRING,
+	PLIST_UID,
+	PLIST_ARRAY,
+	PLIST_DICT,
+} plist_type_t;
+
+// Reader of a binary plist, the data has to stay around as long as the reader
+typedef struct {
+	const unsigned char *data;
+	size_t length;
+	const unsigned char *offsets; // Offset table, also the end of the objects
+	unsigned int offset_size, ref_size;
+	uint64_t count;
+	plist_ref_t objects; // The $objects array of the keyed archive
+	GHashTable *strings; // Ref -> decoded 0-terminated UTF-8 string
+} note_plist_t;
+
+// Parsed marker of an object
+typedef struct {
+	plist_type_t type;
+	unsigned char marker; // Type in the high nibble, size or length in the low one
+	const unsigned char *payload; // Bytes after the marker and length
+	uint64_t count; // Bytes, characters or elements, depending on type
+	int unicode; // Strings: UTF-16BE instead of ASCII
+} plist_object_t;
+
+#define PLIST_HEADER "bplist00"
+#define PLIST_TRAILER 32
+
+// Reads a big-endian unsigned integer of 1 to 8 bytes
+static uint64_t plist_read_uint(const unsigned char *data, unsigned int size)
+{
+	uint64_t val = 0;
+	for (unsigned int i = 0; i < size; i++)
+		val = (val << 8) | data[i];
+	return val;
+}
+
+// Returns 0 if the object doesn't exist or doesn't fit into the plist
+static int plist_object(const note_plist_t *plist, plist_ref_t ref, plist_object_t *object)
+{
+	object->type = PLIST_NONE;
+	if (!ref || ref > plist->count)
+		return 0;
+
+	uint64_t offset = plist_read_uint(plist->offsets + (ref - 1) * plist->offset_size,
+					  plist->offset_size);
+	const unsigned char *end = plist->offsets;
+	if (offset < sizeof(PLIST_HEADER) - 1 || offset >= (uint64_t)(end - plist->data))
+		return 0;
+
+	const unsigned char *marker = plist->data + offset;
+	const unsigned char *payload = marker + 1;
+	unsigned int high = *marker >> 4, low = *marker & 0xf;
+	uint64_t count = low, size = 0;
+	object->marker = *marker;
+	object->unicode = 0;
+
+	// Lengths of 15 and above follow as an integer object
+	if ((high == 0x4 || high == 0x5 || high == 0x6 || high == 0xa || high == 0xd) &&
+	    low == 0xf) {
+		if (end - payload < 1 || *payload >> 4 != 0x1 || (*payload & 0xf) > 3)
+			return 0;
+		unsigned int length_size = 1 << (*payload & 0xf);
+		if ((size_t)(end - payload) < 1 + length_size)
+			return 0;
+		count = plist_read_uint(payload + 1, length_size);
+		payload += 1 + length_size;
+	}
+
+	switch (high) {
+	case 0x0:
+		if (low != 0x8 && low != 0x9)
+			return 0;
+		object->type = PLIST_BOOLEAN; // The value is in the marker itself
+		count = 0;
+		break;
+	case 0x1:
+		if (low > 4)
+			return 0;
+		object->type = PLIST_UINT;
+		count = 0;
+		size = 1 << low;
+		break;
+	case 0x2:
+		if (low != 2 && low != 3)
+			return 0;
+		object->type = PLIST_REAL;
+		count = 0;
+		size = 1 << low;
+		break;
+	case 0x3:
+		if (low != 3)
+			return 0;
+		object->type = PLIST_DATE;
+		count = 0;
+		size = 8;
+		break;
+	case 0x4:
+		object->type = PLIST_DATA;
+		size = count;
+		break;
+	case 0x5:
+		object->type = PLIST_STRING;
+		size = count;
+		break;
+	case 0x6:
+		object->type = PLIST_STRING;
+		object->unicode = 1;
+		size = count * 2;
+		break;
+	case 0x8:
+		object->type = PLIST_UID;
+		count = 0;
+		size = low + 1;
+		break;
+	case 0xa:
+		object->type = PLIST_ARRAY;
+		size = count * plist->ref_size;
+		break;
+	case 0xd:
+		object->type = PLIST_DICT;
+		size = count * plist->ref_size * 2;
+		break;
+	default:
+		return 0;
+	}
+
+	// Also catches overflowing sizes of corrupted lengths
+	if (count > (uint64_t)(end - payload) || size > (uint64_t)(end - payload)) {
+		object->type = PLIST_NONE;
+		return 0;
+	}
+
+	object->payload = payload;
+	object->count = count;
+	return 1;
+}
+
+static plist_type_t plist_type(const note_plist_t *plist, plist_ref_t ref)
+{
+	plist_object_t object;
+	plist_object(plist, ref, &object);
+	return object.type;
+}
+
+// Returns 0 if it isn't an array or index is out of bounds
+static plist_ref_t plist_array_item(const note_plist_t *plist, plist_ref_t array,
+				    uint64_t index)
+{
+	plist_object_t object;
+	if (!plist_object(plist, array, &object) || object.type != PLIST_ARRAY ||
+	    index >= object.count)
+		return 0;
+	return plist_read_uint(object.payload + index * plist->ref_size, plist->ref_size) + 1;
+}
+
+static uint64_t plist_array_size(const note_plist_t *plist, plist_ref_t array)
+{
+	plist_object_t object;
+	if (!plist_object(plist, array, &object) || object.type != PLIST_ARRAY)
+		return 0;
+	return object.count;
+}
+
+// Decodes the string on first use, it's owned by the reader
+static const char *plist_string(note_plist_t *plist, plist_ref_t ref, size_t *length)
+{
+	plist_object_t object;
+	if (!plist_object(plist, ref, &object) || object.type != PLIST_STRING)
+		return 0;
+
+	char *string = g_hash_table_lookup(plist->strings, (gpointer)(uintptr_t)ref);
+	if (!string) {
+		if (object.unicode) {
+			gunichar2 *units = g_new(gunichar2, object.count + 1);
+			for (uint64_t i = 0; i < object.count; i++)
+				units[i] = plist_read_uint(object.payload + i * 2, 2);
+			string = g_utf16_to_utf8(units, object.count, NULL, NULL, NULL);
+			g_free(units);
+			if (!string)
+				string = g_strdup("");
+		} else {
+			string = g_strndup((const char *)object.payload, object.count);
+		}
+		g_hash_table_insert(plist->strings, (gpointer)(uintptr_t)ref, string);
+	}
+
+	if (length)
+		*length = strlen(string);
+	return string;
+}
+
+// Key and value of the index-th entry, returns the value or 0
+static plist_ref_t plist_dict_entry(const note_plist_t *plist, plist_ref_t dict, uint64_t index,
+				    plist_ref_t *key)
+{
+	plist_object_t object;
+	if (!plist_object(plist, dict, &object) || object.type != PLIST_DICT ||
+	    index >= object.count)
+		return 0;
+	const unsigned char *refs = object.payload + index * plist->ref_size;
+	*key = plist_read_uint(refs, plist->ref_size) + 1;
+	return plist_read_uint(refs + object.count * plist->ref_size, plist->ref_size) + 1;
+}
+
+// Keys are compared in place, only unicode ones have to be decoded
+static plist_ref_t plist_dict_item(note_plist_t *plist, plist_ref_t dict, const char *name)
+{
+	plist_object_t object;
+	if (!plist_object(plist, dict, &object) || object.type != PLIST_DICT)
+		return 0;
+
+	size_t name_length = strlen(name);
+	for (uint64_t i = 0; i < object.count; i++) {
+		plist_ref_t key;
+		plist_ref_t value = plist_dict_entry(plist, dict, i, &key);
+
+		plist_object_t key_object;
+		if (!plist_object(plist, key, &key_object) || key_object.type != PLIST_STRING)
+			continue;
+		if (key_object.unicode) {
+			if (!strcmp(plist_string(plist, key, 0), name))
+				return value;
+		} else if (key_object.count == name_length &&
+			   !memcmp(key_object.payload, name, name_length)) {
+			return value;
+		}
+	}
+	return 0;
+}
+
+// Points straight into the plist, not aligned in any way
+static const void *plist_data(const note_plist_t *plist, plist_ref_t ref, size_t *length)
+{
+	plist_object_t object;
+	if (!plist_object(plist, ref, &object) || object.type != PLIST_DATA)
+		return 0;
+	*length = object.count;
+	return object.payload;
+}
+
+static int plist_bool(const note_plist_t *plist, plist_ref_t ref)
+{
+	plist_object_t object;
+	if (!plist_object(plist, ref, &object) || object.type != PLIST_BOOLEAN)
+		return 0;
+	return (object.marker & 0xf) == 0x9;
+}
+
+// Also used for UIDs
+static uint64_t plist_uint(const note_plist_t *plist, plist_ref_t ref)
+{
+	plist_object_t object;
+	if (!plist_object(plist, ref, &object))
+		return 0;
+	if (object.type == PLIST_UID)
+		return plist_read_uint(object.payload, (object.marker & 0xf) + 1);
+	if (object.type != PLIST_UINT)
+		return 0;
+	unsigned int size = 1 << (object.marker & 0xf);
+	// 128-bit integers only appear for values above 2^63, take the low half
+	return size > 8 ? plist_read_uint(object.payload + 8, 8) :
+			  plist_read_uint(object.payload, size);
+}
+
+// Also used for dates (seconds since 01/01/2001)
+static double plist_real(const note_plist_t *plist, plist_ref_t ref)
+{
+	plist_object_t object;
+	if (!plist_object(plist, ref, &object) ||
+	    (object.type != PLIST_REAL && object.type != PLIST_DATE))
+		return 0;
+	if ((object.marker & 0xf) == 2) {
+		uint32_t single_bits = plist_read_uint(object.payload, 4);
+		float single;
+		memcpy(&single, &single_bits, sizeof(single));
+		return single;
+	}
+	uint64_t bits = plist_read_uint(object.payload, 8);
+	double val;
+	memcpy(&val, &bits, sizeof(val));
+	return val;
+}
+
+// Objects of keyed archives reference each other by UIDs, which are indices in $objects
+// A UID never refers to another UID, that could only loop forever
+static plist_ref_t plist_resolve(const note_plist_t *plist, plist_ref_t uid)
+{
+	plist_ref_t ref = plist_array_item(plist, plist->objects, plist_uint(plist, uid));
+	return plist_type(plist, ref) == PLIST_UID ? 0 : ref;
+}
+
+// Returns 0 if the data isn't a binary keyed archive
+static int plist_open(note_plist_t *plist, const void *data, size_t length)
+{
+	memset(plist, 0, sizeof(*plist));
+	if (length < sizeof(PLIST_HEADER) - 1 + PLIST_TRAILER ||
+	    memcmp(data, PLIST_HEADER, sizeof(PLIST_HEADER) - 1))
+		return 0;
+
+	// 6 unused bytes, sizes of offsets and refs, number of objects, top object and
+	// offset of the offset table
+	const unsigned char *trailer = (const unsigned char *)data + length - PLIST_TRAILER;
+	unsigned int offset_size = trailer[6], ref_size = trailer[7];
+	uint64_t count = plist_read_uint(trailer + 8, 8);
+	uint64_t top = plist_read_uint(trailer + 16, 8);
+	uint64_t table = plist_read_uint(trailer + 24, 8);
+	if (offset_size < 1 || offset_size > 8 || ref_size < 1 || ref_size > 8 ||
+	    top >= count || table >= length - PLIST_TRAILER ||
+	    count > (length - PLIST_TRAILER - table) / offset_size)
+		return 0;
+
+	plist->data = data;
+	plist->length = length;
+	plist->offsets = plist->data + table;
+	plist->offset_size = offset_size;
+	plist->ref_size = ref_size;
+	plist->count = count;
+	plist->strings = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+
+	plist->objects = plist_dict_item(plist, top + 1, "$objects");
+	if (plist_type(plist, plist->objects) != PLIST_ARRAY) {
+		g_hash_table_destroy(plist->strings);
+		return 0;
+	}
+	return 1;
+}
+
+static void plist_close(note_plist_t *plist)
+{
+	g_hash_table_destroy(plist->strings);
+}
+
+// For debugging/reverse engineering
+#define INDENT 4
+static void plist_dump(note_plist_t *plist, plist_ref_t ref, int depth)
+{
+	for (int i = 0; i < depth * INDENT; i++)
+		printf(" ");
+
+	plist_type_t type = plist_type(plist, ref);
+	if (type == PLIST_BOOLEAN) {
+		printf("<bool>%s</bool>\n", plist_bool(plist, ref) ? "true" : "false");
+	} else if (type == PLIST_UINT) {
+		printf("<uint>%lu</uint>\n", (unsigned long)plist_uint(plist, ref));
+	} else if (type == PLIST_REAL) {
+		printf("<real>%f</real>\n", plist_real(plist, ref));
+	} else if (type == PLIST_STRING) {
+		printf("<string>%s</string>\n", plist_string(plist, ref, 0));
+	} else if (type == PLIST_ARRAY) {
+		printf("<array>\n");
+		uint64_t size = plist_array_size(plist, ref);
+		for (uint64_t id = 0; id < size; id++) {
+			for (int i = 0; i < (depth + 1) * INDENT; i++)
+				printf(" ");
+			printf("<array_item id=\"%lu\">\n", (unsigned long)id);
+
+			plist_dump(plist, plist_array_item(plist, ref, id), depth + 2);
+
+			for (int i = 0; i < (depth + 1) * INDENT; i++)
+				printf(" ");
+			printf("</array_item>\n");
+		}
+		for (int i = 0; i < depth * INDENT; i++)
+			printf(" ");
+		printf("</array>\n");
+	} else if (type == PLIST_DICT) {
+		printf("<dict>\n");
+		plist_ref_t key, val;
+		for (uint64_t id = 0; (val = plist_dict_entry(plist, ref, id, &key)); id++) {
+			const char *name = plist_string(plist, key, 0);
+			for (int i = 0; i < (depth + 1) * INDENT; i++)
+				printf(" ");
+			printf("<dict_item key=\"%s\" id=\"%lu\">\n", name ? name : "",
+			       (unsigned long)id);
+
+			plist_dump(plist, val, depth + 2);
+
+			for (int i = 0; i < (depth + 1) * INDENT; i++)
+				printf(" ");
+			printf("</dict_item>\n");
+		}
+		for (int i = 0; i < depth * INDENT; i++)
+			printf(" ");
+		printf("</dict>\n");
+	} else if (type == PLIST_DATE) {
+		printf("<date>%d</date>\n", (int)plist_real(plist, ref)); // Since 01/01/2001
+	} else if (type == PLIST_DATA) {
+		size_t length;
+		plist_data(plist, ref, &length);
+		printf("<data length=\"%lu\">...</data>\n", length);
+	} else if (type == PLIST_UID) {
+		printf("<uid>%lu</uid>\n", (unsigned long)plist_uint(plist, ref));
+	}
+}
+
+// Session.plist stays in blob, everything taken from the reader points into it
+static zathura_error_t plist_load(note_archive_t *archive, note_plist_t *plist,
+				  note_blob_t *blob, const char *path, note_profile_t *profile)
+{
+	if (!note_archive_read(archive, path, blob, profile)) {
+		fprintf(stderr, "Unexpected file format of '%s'\n", path);
+		note_archive_release(archive, blob);
+		return ZATHURA_ERROR_INVALID_ARGUMENTS;
+	}
+
+	note_profile_begin(profile, NOTE_PHASE_PLIST);
+	int valid = plist_open(plist, blob->data, blob->length);
+	note_profile_end(profile, NOTE_PHASE_PLIST);
+	if (!valid) {
+		fprintf(stderr, "Unexpected file format of '%s'\n", path);
+		note_archive_release(archive, blob);
+		return ZATHURA_ERROR_INVALID_ARGUMENTS;
+	}
+	return ZATHURA_ERROR_OK;
+}
+
+static const void *plist_dict_get_data(note_plist_t *plist, plist_ref_t node, const char *name,
+				       size_t *length)
+{
+	return plist_data(plist, plist_dict_item(plist, node, name), length);
+}
+
+// Magic unicorn function to reduce ugliness of plist
+// Starts at the $objects array, only the objects on the way are decoded
+static plist_ref_t plist_access(note_plist_t *plist, int length, ...)
+{
+	va_list va;
+	va_start(va, length);
+
+	const char **ptr, *dict_key;
+	plist_ref_t current = plist->objects;
+	int i, array_index;
+	for (i = 0; i < length && current; i++) {
+		plist_type_t type = plist_type(plist, current);
+		switch (type) {
+		case PLIST_ARRAY:
+			array_index = va_arg(va, int);
+			current = plist_array_item(plist, current, array_index);
+			if (!current)
+				fprintf(stderr, "Couldn't find %d in array\n", array_index);
+			break;
+		case PLIST_DICT:
+			dict_key = va_arg(va, const char *);
+			current = plist_dict_item(plist, current, dict_key);
+			if (!current)
+				fprintf(stderr, "Couldn't find '%s' in dict\n", dict_key);
+			break;
+		case PLIST_UID: // Automatic tracing!
+			current = plist_resolve(plist, current);
+			i--; // UID doesn't count
+			break;
+		case PLIST_DATA:
+			if (i + 2 < length)
+				fprintf(stderr, "Unexpected data\n");
+			ptr = va_arg(va, const char **);
+			*ptr = plist_data(plist, current, va_arg(va, size_t *));
+			goto end;
+		case PLIST_STRING:
+			if (i + 2 < length)
+				fprintf(stderr, "Unexpected string\n");
+			ptr = va_arg(va, const char **);
+			*ptr = plist_string(plist, current, va_arg(va, size_t *));
+			goto end;
+		case PLIST_BOOLEAN:
+			if (i + 1 < length)
+				fprintf(stderr, "Unexpected bool\n");
+			*va_arg(va, unsigned char *) = plist_bool(plist, current);
+			goto end;
+		case PLIST_UINT:
+			if (i + 1 < length)
+				fprintf(stderr, "Unexpected uint\n");
+			*va_arg(va, unsigned long *) = plist_uint(plist, current);
+			goto end;
+		case PLIST_REAL:
+			if (i + 1 < length)
+				fprintf(stderr, "Unexpected real\n");
+			*va_arg(va, double *) = plist_real(plist, current);
+			goto end;
+		default:
+			fprintf(stderr, "Unknown plist type in access loop\n");
+			current = 0;
+		}
+	}
+
+	if (i != length)
+		fprintf(stderr, "Unexptected end of access loop\n");
+
+end:
+	// Resolve current if UID
+	if (plist_type(plist, current) == PLIST_UID)
+		current = plist_resolve(plist, current);
+
+	va_end(va);
+
+	// TODO: Exit entire zathura in these conditions? Hmmm
+	if (!current)
+		fprintf(stderr, "Fatal failure in access loop\n");
+
+	return current;
+}
+
+static plist_ref_t plist_handwriting_overlay(note_plist_t *plist)
+{
+	plist_ref_t overlay = plist_access(plist, 3, SESSION_OBJECTS_GLOBAL_TEXT_STORE,
+					   "Handwriting Overlay", "SpatialHash");
+
+	if (plist_type(plist, overlay) != PLIST_DICT) {
+		fprintf(stderr, "Invalid handwriting overlay\n");
+		return 0;
+	}
+
+	return overlay;
+}
+
+// Converts the strange "{42.123, 69.123}" format to respective floats
+static void plist_string_to_floats(const char *string, float *a, float *b)
+{
+	char *end;
+	*a = strtof(string + 1, &end);
+	*b = strtof(end + 2, NULL);
+}
+
+// Strings in the plist aren't terminated, and a missing one has length 0
+static int plist_string_is(const char *string, size_t length, const char *literal)
+{
+	return length == strlen(literal) && !memcmp(string, literal, length);
+}
+
+static float plist_page_ratio(note_plist_t *plist)
+{
+	float ratio = 1.414; // Default is DIN ratio because why not
+
+	const char *type = "";
+	size_t type_length = 0;
+	plist_access(plist, 6, SESSION_OBJECTS_GENERAL_INFO,
+		     "NBNoteTakingSessionDocumentPaperLayoutModelKey", "documentPaperAttributes",
+		     "paperIdentifier", &type, &type_length);
+
+	if (plist_string_is(type, type_length, "Legacy:13"))
+		ratio = 1.3; // Or does 13 refer to 13x19"??
+	else if (plist_string_is(type, type_length, "Legacy:0"))
+		// 0 means page not renderable (?)
+		fprintf(stderr, "Page identifies as not renderable, please report\n");
+	else
+		fprintf(stderr, "Unknown paper identifier, please report: %s\n", type);
+
+	return ratio;
+}
+
+// Sets reflowable if the global text store has no width of its own
+static float plist_page_width(note_plist_t *plist, int *reflowable)
+{
+	const char *class = "";
+	size_t class_length = 0;
+	plist_access(plist, 6, SESSION_OBJECTS_GLOBAL_TEXT_STORE, "reflowState", "$class",
+		     "$classname", &class, &class_length);
+
+	double val = 500; // Default width if something fails or it's not specified
+
+	if (plist_string_is(class, class_length, "NBReflowStateReflowable")) {
+		*reflowable = 1;
+	} else if (plist_string_is(class, class_length, "NBReflowStateLocked")) {
+		// That's how I like it
+		plist_access(plist, 4, SESSION_OBJECTS_GLOBAL_TEXT_STORE, "reflowState",
+			     "pageWidthInDocumentCoordsKey", &val);
+	} else {
+		fprintf(stderr, "Unknown reflow state '%s', please report\n", class);
+	}
+
+	return val;
+}
+
+/**
+ * Cairo wrappers/utilities
+ */
+
+typedef struct {
+	const char *data;
+	size_t length;
+} cairo_read_closure;
+
+// Cairo is weird. Why can't we just pass a data buffer directly?
 static cairo_status_t cairo_read(void *data, unsigned char *buf, unsigned int length)
 {
-	cairo_read_closure *closure = data;
+	cairo_read_closure *closure = data;
+
+	if (length > closure->length)
+		return CAIRO_STATUS_READ_ERROR;
+
+	memcpy(buf, closure->data, length);
+
+	closure->length -= length;
+	closure->data += length;
+
+	return CAIRO_STATUS_SUCCESS;
+}
+
+static cairo_surface_t *cairo_surface_scale(cairo_surface_t *surface, int width, int height)
+{
+	int unscaled_width = cairo_image_surface_get_width(surface);
+	int unscaled_height = cairo_image_surface_get_height(surface);
+	cairo_surface_t *result = cairo_surface_create_similar(
+		surface, cairo_surface_get_content(surface), width, height);
+	cairo_t *cairo = cairo_create(result);
+	cairo_scale(cairo, width / (double)unscaled_width, height / (double)unscaled_height);
+	cairo_set_source_surface(cairo, surface, 0, 0);
+	cairo_set_operator(cairo, CAIRO_OPERATOR_SOURCE);
+	cairo_paint(cairo);
+	cairo_destroy(cairo);
+	return result;
+}
+
+// Decodes at the smallest DCT scale (1/1, 1/2, 1/4 or 1/8) that still covers
+// width/height, so small placements don't pay for the full resolution
+cairo_surface_t *cairo_image_surface_create_from_jpeg_mem(const void *data, size_t len, int width,
+							   int height)
+{
+	struct jpeg_decompress_struct jpeg;
+	struct jpeg_error_mgr jpeg_err;
+	jpeg.err = jpeg_std_error(&jpeg_err);
+	jpeg_create_decompress(&jpeg);
+	jpeg_mem_src(&jpeg, (unsigned char *)data, len); // Only const in newer versions
+	jpeg_read_header(&jpeg, TRUE);
+
+	jpeg.scale_num = 1;
+	jpeg.scale_denom = 1;
+	while (jpeg.scale_denom < 8 &&
+	       jpeg.image_width / (jpeg.scale_denom * 2) >= (unsigned)width &&
+	       jpeg.image_height / (jpeg.scale_denom * 2) >= (unsigned)height)
+		jpeg.scale_denom *= 2;
+
+#ifdef LIBJPEG_TURBO_VERSION
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	jpeg.out_color_space = JCS_EXT_BGRA;
+#else
+	jpeg.out_color_space = JCS_EXT_ARGB;
+#endif
+#else
+	jpeg.out_color_space = JCS_RGB;
+#endif
+
+	jpeg_start_decompress(&jpeg);
+
+	cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_RGB24, jpeg.output_width,
+							      jpeg.output_height);
+	if (cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS) {
+		jpeg_destroy_decompress(&jpeg);
+		return surface;
+	}
+
+	while (jpeg.output_scanline < jpeg.output_height) {
+		unsigned char *row_address =
+			cairo_image_surface_get_data(surface) +
+			(jpeg.output_scanline * cairo_image_surface_get_stride(surface));
+		JSAMPROW row_pointer = row_address;
+		jpeg_read_scanlines(&jpeg, &row_pointer, 1);
+#ifndef LIBJPEG_TURBO_VERSION
+		pix_conv(row_address, 4, row_address, 3, jpeg.output_width);
+#endif
+	}
+
+	cairo_surface_mark_dirty(surface);
+	jpeg_finish_decompress(&jpeg);
+	jpeg_destroy_decompress(&jpeg);
+	return surface;
+}
+
+typedef struct {
+	cairo_surface_t *surface;
+	unsigned char *data;
+	int stride;
+	uint32_t *sums; // Premultiplied B, G, R, A per output column of the current block
+	png_uint_32 width, height;
+	png_uint_32 rows; // Decoded so far
+	int step; // Every step x step block of pixels becomes one
+} note_png_decoder_t;
+
+static void note_png_info(png_structp png, png_infop info)
+{
+	note_png_decoder_t *decoder = png_get_progressive_ptr(png);
+	int color_type = png_get_color_type(png, info);
+	int alpha = (color_type & PNG_COLOR_MASK_ALPHA) || png_get_valid(png, info, PNG_INFO_tRNS);
+
+	// Everything becomes 8 bit RGBA
+	png_set_expand(png);
+	png_set_strip_16(png);
+	png_set_gray_to_rgb(png);
+	png_set_filler(png, 0xff, PNG_FILLER_AFTER);
+	png_start_read_image(png);
+
+	png_uint_32 step = decoder->step;
+	png_uint_32 width = (decoder->width + step - 1) / step;
+	png_uint_32 height = (decoder->height + step - 1) / step;
+	decoder->surface = cairo_image_surface_create(alpha ? CAIRO_FORMAT_ARGB32 :
+							      CAIRO_FORMAT_RGB24,
+						      width, height);
+	if (cairo_surface_status(decoder->surface) != CAIRO_STATUS_SUCCESS)
+		png_error(png, "Couldn't create surface");
+	cairo_surface_flush(decoder->surface);
+	decoder->data = cairo_image_surface_get_data(decoder->surface);
+	decoder->stride = cairo_image_surface_get_stride(decoder->surface);
+	decoder->sums = calloc((size_t)width * 4, sizeof(*decoder->sums));
+	if (!decoder->sums)
+		png_error(png, "Out of memory");
+}
+
+// Premultiplies straight into the surface, or sums up step rows first when decimating
+static void note_png_row(png_structp png, png_bytep row, png_uint_32 number, int pass)
+{
+	(void)pass;
+	note_png_decoder_t *decoder = png_get_progressive_ptr(png);
+	if (!row)
+		return;
+	decoder->rows++;
+
+	uint32_t *target = (uint32_t *)(decoder->data + (number / decoder->step) * decoder->stride);
+	if (decoder->step == 1) {
+		for (png_uint_32 x = 0; x < decoder->width; x++, row += 4) {
+			uint32_t a = row[3];
+			uint32_t r = (row[0] * a + 127) / 255;
+			uint32_t g = (row[1] * a + 127) / 255;
+			uint32_t b = (row[2] * a + 127) / 255;
+			target[x] = a << 24 | r << 16 | g << 8 | b;
+		}
+		return;
+	}
+
+	uint32_t *sums = decoder->sums;
+	for (png_uint_32 x = 0; x < decoder->width; x++, row += 4) {
+		uint32_t a = row[3];
+		uint32_t *sum = &sums[(x / decoder->step) * 4];
+		sum[0] += (row[2] * a + 127) / 255;
+		sum[1] += (row[1] * a + 127) / 255;
+		sum[2] += (row[0] * a + 127) / 255;
+		sum[3] += a;
+	}
+
+	png_uint_32 rows = number % decoder->step + 1;
+	if (rows != (png_uint_32)decoder->step && number + 1 != decoder->height)
+		return;
+
+	// Edge blocks are cut off by the image size
+	png_uint_32 columns = (decoder->width + decoder->step - 1) / decoder->step;
+	for (png_uint_32 x = 0; x < columns; x++, sums += 4) {
+		png_uint_32 pixels = rows * (x + 1 < columns ? (png_uint_32)decoder->step :
+							       decoder->width - x * decoder->step);
+		target[x] = (sums[3] + pixels / 2) / pixels << 24 |
+			    (sums[2] + pixels / 2) / pixels << 16 |
+			    (sums[1] + pixels / 2) / pixels << 8 | (sums[0] + pixels / 2) / pixels;
+	}
+	memset(decoder->sums, 0, (size_t)columns * 4 * sizeof(*decoder->sums));
+}
+
+// Feeds the whole buffer to libpng's progressive reader at once, which writes the rows
+// into the surface while it inflates. Like the JPEG decoder it decimates by 2, 4 or 8 as
+// long as that still covers width/height. Returns 0 for interlaced images, which would
+// need a full-size buffer to combine the passes, cairo's reader handles those.
+static cairo_surface_t *cairo_image_surface_create_from_png_mem(const void *data, size_t len,
+								int width, int height)
+{
+	// The IHDR chunk always comes first
+	const unsigned char *bytes = data;
+	if (len < 33 || png_sig_cmp(bytes, 0, 8) || memcmp(bytes + 12, "IHDR", 4) || bytes[28])
+		return 0;
+
+	// Allocated, as the callbacks change it between setjmp and longjmp
+	note_png_decoder_t *decoder = calloc(1, sizeof(*decoder));
+	decoder->width = png_get_uint_32(bytes + 16);
+	decoder->height = png_get_uint_32(bytes + 20);
+	decoder->step = 1;
+	while (decoder->step < 8 && decoder->width / (decoder->step * 2) >= (unsigned)width &&
+	       decoder->height / (decoder->step * 2) >= (unsigned)height)
+		decoder->step *= 2;
+
+	png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, 0, 0, 0);
+	png_infop info = png ? png_create_info_struct(png) : 0;
+	if (!info) {
+		png_destroy_read_struct(&png, 0, 0);
+		free(decoder);
+		return 0;
+	}
+
+	cairo_surface_t *surface = 0;
+	if (!setjmp(png_jmpbuf(png))) {
+		png_set_progressive_read_fn(png, decoder, note_png_info, note_png_row, 0);
+		png_process_data(png, info, (png_bytep)data, len); // Only read, despite the type
+		if (decoder->surface && decoder->rows == decoder->height) {
+			surface = decoder->surface;
+			cairo_surface_mark_dirty(surface);
+		}
+	}
+	png_destroy_read_struct(&png, &info, 0);
+
+	// Broken or truncated
+	if (!surface) {
+		if (decoder->surface)
+			cairo_surface_destroy(decoder->surface);
+		surface = cairo_image_surface_create(CAIRO_FORMAT_INVALID, 0, 0);
+	}
+	free(decoder->sums);
+	free(decoder);
+	return surface;
+}
+
+/**
+ * Image cache
+ */
+
+typedef struct {
+	char *key; // "relativePath@crc@widthxheight"
+	cairo_surface_t *surface;
+	size_t size;
+	gint64 used; // Monotonic time, compared across caches by note_document_fit_budget
+} note_image_t;
+
+// Part of the cache keys of an image, so surfaces of a replaced image aren't hit after
+// reopening the document, see note_reload
+static unsigned int note_image_crc(note_document_t *note_document, const char *path)
+{
+	const note_archive_entry_t *entry = note_archive_entry(&note_document->archive, path);
+	return entry ? entry->crc : 0;
+}
+
+static void note_image_cache_init(note_image_cache_t *cache, size_t budget)
+{
+	g_mutex_init(&cache->lock);
+	cache->images = g_hash_table_new(g_str_hash, g_str_equal);
+	g_queue_init(&cache->lru);
+	cache->size = 0;
+	cache->budget = budget;
+}
+
+static void note_image_cache_evict(note_image_cache_t *cache)
+{
+	GList *link = g_queue_pop_tail_link(&cache->lru);
+	note_image_t *image = link->data;
+	g_hash_table_remove(cache->images, image->key);
+	cache->size -= image->size;
+	cairo_surface_destroy(image->surface);
+	free(image->key);
+	free(image);
+	g_list_free_1(link);
+}
+
+// Returns a new reference to the cached surface or 0
+static cairo_surface_t *note_image_cache_lookup(note_image_cache_t *cache, const char *key)
+{
+	g_mutex_lock(&cache->lock);
+	GList *link = g_hash_table_lookup(cache->images, key);
+	if (!link) {
+		g_mutex_unlock(&cache->lock);
+		return 0;
+	}
+
+	g_queue_unlink(&cache->lru, link);
+	g_queue_push_head_link(&cache->lru, link);
+
+	note_image_t *image = link->data;
+	image->used = g_get_monotonic_time();
+	cairo_surface_t *surface = cairo_surface_reference(image->surface);
+	g_mutex_unlock(&cache->lock);
+	return surface;
+}
+
+// Keeps its own reference of surface, evicting older images if over budget
+static void note_image_cache_insert(note_image_cache_t *cache, const char *key,
+				    cairo_surface_t *surface)
+{
+	size_t size = (size_t)cairo_image_surface_get_stride(surface) *
+			      cairo_image_surface_get_height(surface) +
+		      IMAGE_ENTRY_SIZE + strlen(key);
+
+	g_mutex_lock(&cache->lock);
+
+	// Another render may have decoded the same image in the meantime
+	if (size > cache->budget || g_hash_table_contains(cache->images, key)) {
+		g_mutex_unlock(&cache->lock);
+		return;
+	}
+
+	while (cache->size + size > cache->budget)
+		note_image_cache_evict(cache);
+
+	note_image_t *image = malloc(sizeof(*image));
+	image->key = strdup(key);
+	image->surface = cairo_surface_reference(surface);
+	image->size = size;
+	image->used = g_get_monotonic_time();
+
+	g_queue_push_head(&cache->lru, image);
+	g_hash_table_insert(cache->images, image->key, cache->lru.head);
+	cache->size += size;
+	g_mutex_unlock(&cache->lock);
+}
+
+// Evicts the least recently used images until the cache fits into budget
+static void note_image_cache_trim(note_image_cache_t *cache, size_t budget)
+{
+	g_mutex_lock(&cache->lock);
+	while (cache->lru.length && cache->size > budget)
+		note_image_cache_evict(cache);
+	g_mutex_unlock(&cache->lock);
+}
+
+static size_t note_image_cache_size(note_image_cache_t *cache)
+{
+	g_mutex_lock(&cache->lock);
+	size_t size = cache->size;
+	g_mutex_unlock(&cache->lock);
+	return size;
+}
+
+// Last use of the least recently used image, G_MAXINT64 if the cache is empty
+static gint64 note_image_cache_oldest(note_image_cache_t *cache)
+{
+	g_mutex_lock(&cache->lock);
+	gint64 used = cache->lru.length ? ((note_image_t *)cache->lru.tail->data)->used :
+					    G_MAXINT64;
+	g_mutex_unlock(&cache->lock);
+	return used;
+}
+
+// Makes the images whose keys start with prefix the next ones to be evicted
+static void note_image_cache_demote(note_image_cache_t *cache, const char *prefix)
+{
+	size_t length = strlen(prefix);
+	g_mutex_lock(&cache->lock);
+	GList *link = cache->lru.head;
+	for (guint i = 0; i < cache->lru.length; i++) {
+		GList *next = link->next;
+		note_image_t *image = link->data;
+		if (!strncmp(image->key, prefix, length)) {
+			image->used = 0;
+			g_queue_unlink(&cache->lru, link);
+			g_queue_push_tail_link(&cache->lru, link);
+		}
+		link = next;
+	}
+	g_mutex_unlock(&cache->lock);
+}
+
+static void note_image_cache_evict_oldest(note_image_cache_t *cache)
+{
+	g_mutex_lock(&cache->lock);
+	if (cache->lru.length)
+		note_image_cache_evict(cache);
+	g_mutex_unlock(&cache->lock);
+}
+
+// Exchanges the images of two caches nobody else uses right now, budgets stay
+static void note_image_cache_swap(note_image_cache_t *a, note_image_cache_t *b)
+{
+	GHashTable *images = a->images;
+	GQueue lru = a->lru;
+	size_t size = a->size;
+	a->images = b->images;
+	a->lru = b->lru;
+	a->size = b->size;
+	b->images = images;
+	b->lru = lru;
+	b->size = size;
+}
+
+static void note_image_cache_clear(note_image_cache_t *cache)
+{
+	while (cache->lru.length)
+		note_image_cache_evict(cache);
+	g_hash_table_destroy(cache->images);
+	g_mutex_clear(&cache->lock);
+}
+
+/**
+ * Text layout cache
+ */
+
+static void note_text_cache_init(note_text_cache_t *cache, size_t runs, size_t pages)
+{
+	g_mutex_init(&cache->lock);
+	cache->font_map = pango_cairo_font_map_new();
+	cache->context = pango_font_map_create_context(cache->font_map);
+	cache->font_options = 0;
+	cache->fonts = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+					     (GDestroyNotify)pango_font_description_free);
+	cache->layouts = calloc(runs + 1, sizeof(*cache->layouts));
+	cache->layouts_length = runs;
+	g_queue_init(&cache->lru);
+	cache->links = calloc(runs + 1, sizeof(*cache->links));
+	cache->used = calloc(runs + 1, sizeof(*cache->used));
+	cache->size = 0;
+	cache->pages = calloc(pages + 1, sizeof(*cache->pages));
+	cache->pages_length = pages;
+	cache->wrap_block = 0;
+	cache->wrap_width = 0;
+}
+
+// Layouts are shaped in document units with unhinted metrics, so they don't depend
+// on the zoom and only need to be reshaped if the target's font options change
+static void note_text_cache_update(note_text_cache_t *cache, cairo_t *cairo)
+{
+	cairo_font_options_t *options = cairo_font_options_create();
+	cairo_font_options_t *cairo_options = cairo_font_options_create();
+	cairo_surface_get_font_options(cairo_get_target(cairo), options);
+	cairo_get_font_options(cairo, cairo_options);
+	cairo_font_options_merge(options, cairo_options);
+	cairo_font_options_set_hint_metrics(options, CAIRO_HINT_METRICS_OFF);
+	cairo_font_options_destroy(cairo_options);
+
+	if (cache->font_options && cairo_font_options_equal(options, cache->font_options)) {
+		cairo_font_options_destroy(options);
+		return;
+	}
+
+	if (cache->font_options)
+		cairo_font_options_destroy(cache->font_options);
+	cache->font_options = options;
+	pango_cairo_context_set_font_options(cache->context, options);
+
+	for (size_t i = 0; i < cache->layouts_length; i++)
+		if (cache->layouts[i])
+			pango_layout_context_changed(cache->layouts[i]);
+}
+
+// Descriptions are shared by all runs with the same family and size
+static PangoFontDescription *note_text_cache_font(note_text_cache_t *cache,
+						  const note_model_t *model,
+						  const note_text_run_t *run)
+{
+	char key[32];
+	snprintf(key, sizeof(key), "%u/%d", run->font, run->font_size);
+	PangoFontDescription *description = g_hash_table_lookup(cache->fonts, key);
+	if (description)
+		return description;
+
+	description = pango_font_description_new();
+	pango_font_description_set_absolute_size(description,
+						 run->font_size * PANGO_SCALE); // TODO: ?
+	pango_font_description_set_family_static(description, &model->strings[run->font]);
+	g_hash_table_insert(cache->fonts, g_strdup(key), description);
+	return description;
+}
+
+// Shaped like renders do if nothing has been rendered yet
+static void note_text_cache_default_options(note_text_cache_t *cache)
+{
+	if (cache->font_options)
+		return;
+	cache->font_options = cairo_font_options_create();
+	cairo_font_options_set_hint_metrics(cache->font_options, CAIRO_HINT_METRICS_OFF);
+	pango_cairo_context_set_font_options(cache->context, cache->font_options);
+}
+
+// Metrics aren't hinted, so lines break the same at every zoom
+static void note_text_wrap(PangoLayout *layout, float width)
+{
+	pango_layout_set_width(layout, width * PANGO_SCALE);
+	pango_layout_set_wrap(layout, PANGO_WRAP_WORD_CHAR);
+}
+
+// Rough memory of a shaped layout, Pango keeps a few structs per glyph
+static size_t note_text_layout_size(const note_text_run_t *run)
+{
+	return LAYOUT_SIZE + (size_t)(run->end - run->start) * LAYOUT_SIZE_PER_BYTE;
+}
+
+static PangoLayout *note_text_cache_layout(note_text_cache_t *cache, const note_model_t *model,
+					   const note_text_block_t *block, unsigned int run,
+					   note_profile_t *profile)
+{
+	cache->used[run] = g_get_monotonic_time();
+	if (cache->layouts[run]) {
+		g_queue_unlink(&cache->lru, cache->links[run]);
+		g_queue_push_head_link(&cache->lru, cache->links[run]);
+		return cache->layouts[run];
+	}
+
+	note_profile_begin(profile, NOTE_PHASE_LAYOUT);
+	const note_text_run_t *text_run = &model->runs[run];
+	PangoLayout *layout = pango_layout_new(cache->context);
+	pango_layout_set_font_description(layout, note_text_cache_font(cache, model, text_run));
+	pango_layout_set_text(layout, &model->strings[block->text] + text_run->start,
+			      text_run->end - text_run->start);
+	if (block == cache->wrap_block)
+		note_text_wrap(layout, cache->wrap_width);
+	if (profile->enabled)
+		pango_layout_get_line_count(layout); // Shape now, so it's timed as layout
+	note_profile_end(profile, NOTE_PHASE_LAYOUT);
+	note_profile_count(profile, NOTE_COUNTER_LAYOUTS_CREATED, 1);
+
+	cache->layouts[run] = layout;
+	g_queue_push_head(&cache->lru, GUINT_TO_POINTER(run));
+	cache->links[run] = cache->lru.head;
+	cache->size += note_text_layout_size(text_run);
+	return layout;
+}
+
+// Frees the least recently used layout, it's shaped again when it's needed
+// Expects the cache to be locked
+static void note_text_cache_evict(note_text_cache_t *cache, const note_model_t *model)
+{
+	GList *link = g_queue_pop_tail_link(&cache->lru);
+	unsigned int run = GPOINTER_TO_UINT(link->data);
+	g_object_unref(cache->layouts[run]);
+	cache->layouts[run] = 0;
+	cache->links[run] = 0;
+	cache->size -= note_text_layout_size(&model->runs[run]);
+	g_list_free_1(link);
+}
+
+// Makes the layout of run the next one to be evicted, expects the cache to be locked
+static void note_text_cache_demote(note_text_cache_t *cache, unsigned int run)
+{
+	if (!cache->layouts[run])
+		return;
+	cache->used[run] = 0;
+	g_queue_unlink(&cache->lru, cache->links[run]);
+	g_queue_push_tail_link(&cache->lru, cache->links[run]);
+}
+
+static void note_text_cache_clear(note_text_cache_t *cache)
+{
+	for (size_t i = 0; i < cache->layouts_length; i++)
+		if (cache->layouts[i])
+			g_object_unref(cache->layouts[i]);
+	free(cache->layouts);
+	for (size_t i = 0; i < cache->pages_length; i++) {
+		note_page_text_t *page_text = cache->pages[i];
+		if (!page_text)
+			continue;
+		free(page_text->text);
+		free(page_text->folded);
+		free(page_text->folded_chars);
+		free(page_text->chars);
+		free(page_text);
+	}
+	free(cache->pages);
+	g_queue_clear(&cache->lru);
+	free(cache->links);
+	free(cache->used);
+	g_hash_table_destroy(cache->fonts);
+	if (cache->font_options)
+		cairo_font_options_destroy(cache->font_options);
+	g_object_unref(cache->context);
+	g_object_unref(cache->font_map);
+	g_mutex_clear(&cache->lock);
+}
+
+/**
+ * Arena
+ */
+
+#define ARENA_HEADER \
+	((sizeof(note_arena_block_t) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+// Uninitialized, never 0 (not even for size 0)
+static void *note_arena_alloc(note_arena_t *arena, size_t size)
+{
+	size = size ? (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1) : ARENA_ALIGN;
+
+	note_arena_block_t *block = arena->blocks;
+	if (!block || block->size - block->used < size) {
+		// Big arrays get a block of their own, so the current one keeps its room
+		int own = size > ARENA_BLOCK / 4;
+		size_t capacity = own ? size : ARENA_BLOCK;
+		note_arena_block_t *new = malloc(ARENA_HEADER + capacity);
+		new->used = 0;
+		new->size = capacity;
+		if (own && block) {
+			new->next = block->next;
+			block->next = new;
+		} else {
+			new->next = block;
+			arena->blocks = new;
+		}
+		block = new;
+	}
+
+	void *data = (char *)block + ARENA_HEADER + block->used;
+	block->used += size;
+	arena->size += size;
+	return data;
+}
+
+static void *note_arena_copy(note_arena_t *arena, const void *data, size_t size)
+{
+	void *copy = note_arena_alloc(arena, size);
+	if (size)
+		memcpy(copy, data, size);
+	return copy;
+}
+
+// Moves an array grown with realloc into the arena, which drops its spare capacity
+static void *note_arena_adopt(note_arena_t *arena, void *array, size_t size)
+{
+	void *copy = note_arena_copy(arena, array, size);
+	free(array);
+	return copy;
+}
+
+static void note_arena_free(note_arena_t *arena)
+{
+	note_arena_block_t *block = arena->blocks;
+	while (block) {
+		note_arena_block_t *next = block->next;
+		free(block);
+		block = next;
+	}
+	memset(arena, 0, sizeof(*arena));
+}
+
+/**
+ * Point kernels
+ */
+
+// Bounds of interleaved x/y pairs: Min/max over whole vectors keeps x in the even
+// lanes and y in the odd ones, so the lanes only have to be combined at the end
+typedef void (*note_points_bounds_t)(const float *points, size_t length, note_bounds_t *bounds);
+
+static void note_points_bounds_tail(const float *points, size_t i, size_t length,
+				    note_bounds_t *bounds)
+{
+	for (; i + 2 <= length; i += 2) {
+		if (points[i] < bounds->x1)
+			bounds->x1 = points[i];
+		if (points[i] > bounds->x2)
+			bounds->x2 = points[i];
+		if (points[i + 1] < bounds->y1)
+			bounds->y1 = points[i + 1];
+		if (points[i + 1] > bounds->y2)
+			bounds->y2 = points[i + 1];
+	}
+}
+
+// Combines x, y, x, y lanes of the vector minima and maxima
+static void note_points_bounds_lanes(const float min[4], const float max[4],
+				     note_bounds_t *bounds)
+{
+	bounds->x1 = min[0] < min[2] ? min[0] : min[2];
+	bounds->y1 = min[1] < min[3] ? min[1] : min[3];
+	bounds->x2 = max[0] > max[2] ? max[0] : max[2];
+	bounds->y2 = max[1] > max[3] ? max[1] : max[3];
+}
+
+// Length is the number of floats, at least one pair
+static void note_points_bounds_scalar(const float *points, size_t length, note_bounds_t *bounds)
+{
+	*bounds = (note_bounds_t){ points[0], points[1], points[0], points[1] };
+	note_points_bounds_tail(points, 2, length, bounds);
+}
+
+#if defined(__SSE2__)
+// Baseline on x86-64, two vectors per iteration to hide the latency of min/max
+static void note_points_bounds_sse2(const float *points, size_t length, note_bounds_t *bounds)
+{
+	__m128 first = _mm_setr_ps(points[0], points[1], points[0], points[1]);
+	__m128 min0 = first, max0 = first, min1 = first, max1 = first;
+	size_t i = 0;
+	for (; i + 8 <= length; i += 8) {
+		__m128 a = _mm_loadu_ps(&points[i]), b = _mm_loadu_ps(&points[i + 4]);
+		min0 = _mm_min_ps(min0, a);
+		max0 = _mm_max_ps(max0, a);
+		min1 = _mm_min_ps(min1, b);
+		max1 = _mm_max_ps(max1, b);
+	}
+
+	float min[4], max[4];
+	_mm_storeu_ps(min, _mm_min_ps(min0, min1));
+	_mm_storeu_ps(max, _mm_max_ps(max0, max1));
+	note_points_bounds_lanes(min, max, bounds);
+	note_points_bounds_tail(points, i, length, bounds);
+}
+#endif
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+// Baseline on AArch64
+static void note_points_bounds_neon(const float *points, size_t length, note_bounds_t *bounds)
+{
+	const float pair[4] = { points[0], points[1], points[0], points[1] };
+	float32x4_t first = vld1q_f32(pair);
+	float32x4_t min0 = first, max0 = first, min1 = first, max1 = first;
+	size_t i = 0;
+	for (; i + 8 <= length; i += 8) {
+		float32x4_t a = vld1q_f32(&points[i]), b = vld1q_f32(&points[i + 4]);
+		min0 = vminq_f32(min0, a);
+		max0 = vmaxq_f32(max0, a);
+		min1 = vminq_f32(min1, b);
+		max1 = vmaxq_f32(max1, b);
+	}
+
+	float min[4], max[4];
+	vst1q_f32(min, vminq_f32(min0, min1));
+	vst1q_f32(max, vmaxq_f32(max0, max1));
+	note_points_bounds_lanes(min, max, bounds);
+	note_points_bounds_tail(points, i, length, bounds);
+}
+#endif
+
+// Chosen once, wider vectors don't help as the kernel is bound by memory and most curves
+// are short
+static note_points_bounds_t note_points_bounds_kernel(void)
+{
+	static gsize kernel = 0;
+	if (g_once_init_enter(&kernel)) {
+		note_points_bounds_t chosen = note_points_bounds_scalar;
+		if (env_flag_default("ZATHURA_NOTE_SIMD", 1)) {
+#if defined(__SSE2__)
+			chosen = note_points_bounds_sse2;
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+			chosen = note_points_bounds_neon;
+#endif
+		}
+		g_once_init_leave(&kernel, (gsize)chosen);
+	}
+	return (note_points_bounds_t)kernel;
+}
+
+/**
+ * Render model
+ */
+
+// Bookkeeping while compiling, the model itself only keeps the lengths
+typedef struct {
+	note_plist_t *plist;
+	note_model_t *model;
+	size_t objects_capacity, blocks_capacity, runs_capacity, strings_capacity;
+	GHashTable *fonts; // Font name in plist -> offset in strings + 1
+} note_compiler_t;
+
+// Returns array with room for at least one more element
+static void *array_reserve(void *array, size_t length, size_t *capacity, size_t element_size)
+{
+	if (length < *capacity)
+		return array;
+	*capacity = *capacity ? *capacity * 2 : 16;
+	return realloc(array, *capacity * element_size);
+}
+
+// Returns array with room for at least count more elements
+static void *array_reserve_many(void *array, size_t length, size_t count, size_t *capacity,
+				size_t element_size)
+{
+	while (length + count > *capacity)
+		array = array_reserve(array, *capacity, capacity, element_size);
+	return array;
+}
+
+// Copies length bytes plus a terminating 0 into the string pool
+static unsigned int note_model_add_string(note_compiler_t *compiler, const char *string,
+					  size_t length)
+{
+	note_model_t *model = compiler->model;
+	while (model->strings_length + length + 1 > compiler->strings_capacity)
+		model->strings = array_reserve(model->strings, compiler->strings_capacity,
+					       &compiler->strings_capacity, 1);
+
+	unsigned int offset = model->strings_length;
+	memcpy(model->strings + offset, string, length);
+	model->strings[offset + length] = 0;
+	model->strings_length += length + 1;
+	return offset;
+}
+
+// Font names repeat for nearly every sub range, store each only once
+static unsigned int note_model_add_font(note_compiler_t *compiler, const char *name)
+{
+	if (!name)
+		name = "";
+
+	unsigned int offset = GPOINTER_TO_UINT(g_hash_table_lookup(compiler->fonts, name));
+	if (offset)
+		return offset - 1;
+
+	offset = note_model_add_string(compiler, name, strlen(name));
+	g_hash_table_insert(compiler->fonts, (gpointer)name, GUINT_TO_POINTER(offset + 1));
+	return offset;
+}
+
+// Quantizes the points of every complete curve to 1/POINT_SCALE units, each coordinate stored
+// as the delta to the same coordinate of the previous point of its curve (of 0 for the first
+// point). Pen movements between samples are short, so that's mostly a byte per coordinate
+// instead of a float. points may be unaligned. The bounds of every curve come out of the
+// same pass, so neither the page count nor the stroke index has to decode the curves again
+static void note_strokes_encode(note_strokes_t *strokes, const float *points, size_t length,
+				  note_arena_t *arena)
+{
+	size_t curves = strokes->curves_length;
+	unsigned int *offsets = note_arena_alloc(arena, (curves + 1) * sizeof(*offsets));
+	note_bounds_t *bounds = note_arena_alloc(arena, (curves + 1) * sizeof(*bounds));
+	note_points_bounds_t bounds_kernel = note_points_bounds_kernel();
+	float *decoded = 0; // The points of the curve like note_curve_decode returns them
+	size_t decoded_capacity = 0;
+
+	signed char *encoded = 0;
+	size_t encoded_length = 0, capacity = 0, pos = 0, i = 0;
+	for (; i < curves; i++) {
+		size_t curve_length = strokes->num_points[i] * 2;
+		if (curve_length > length - pos)
+			break;
+
+		offsets[i] = encoded_length;
+		decoded = array_reserve_many(decoded, 0, curve_length, &decoded_capacity,
+					     sizeof(*decoded));
+		int32_t previous[2] = { 0, 0 };
+		for (size_t j = 0; j < curve_length; j++) {
+			float point;
+			memcpy(&point, &points[pos + j], sizeof(point));
+			// Clamped so the deltas fit into int32_t
+			double scaled = isnan(point) ? 0 : point * POINT_SCALE;
+			int32_t value = lrint(fmin(fmax(scaled, -(1 << 30)), 1 << 30));
+			int32_t delta = value - previous[j & 1];
+			previous[j & 1] = value;
+			decoded[j] = (float)value / POINT_SCALE;
+
+			encoded = array_reserve(encoded, encoded_length + sizeof(delta), &capacity,
+						sizeof(*encoded));
+			if (delta > POINT_ESCAPE && delta <= 127) {
+				encoded[encoded_length++] = delta;
+			} else {
+				encoded[encoded_length++] = POINT_ESCAPE;
+				memcpy(&encoded[encoded_length], &delta, sizeof(delta));
+				encoded_length += sizeof(delta);
+			}
+		}
+		pos += curve_length;
+
+		if (curve_length)
+			bounds_kernel(decoded, curve_length, &bounds[i]);
+		else // Empty, touches no page
+			bounds[i] = (note_bounds_t){ 0, 0, -1, -1 };
+	}
+	free(decoded);
+
+	if (i < curves)
+		fprintf(stderr, "Curve points end after %lu of %lu curves, please report\n", i,
+			curves);
+	for (; i < curves; i++) {
+		offsets[i] = encoded_length;
+		bounds[i] = (note_bounds_t){ 0, 0, -1, -1 };
+	}
+
+	strokes->points = note_arena_adopt(arena, encoded, encoded_length);
+	strokes->points_length = encoded_length;
+	strokes->offsets = offsets;
+	strokes->bounds = bounds;
+}
+
+// Decodes length points starting at *offset into points and moves *offset past them,
+// returns the number of points decoded, fewer if the encoded points end early
+static unsigned int note_curve_decode(const note_strokes_t *strokes, size_t *offset,
+				      unsigned int length, float *points)
+{
+	const signed char *encoded = strokes->points;
+	size_t pos = *offset, end = strokes->points_length;
+	uint32_t value[2] = { 0, 0 }; // Wrap around instead of overflowing on garbage
+	size_t i = 0;
+	for (; i < (size_t)length * 2 && pos < end; i++) {
+		int32_t delta = encoded[pos++];
+		if (delta == POINT_ESCAPE) {
+			if (end - pos < sizeof(delta))
+				break;
+			memcpy(&delta, &encoded[pos], sizeof(delta));
+			pos += sizeof(delta);
+		}
+		value[i & 1] += (uint32_t)delta;
+		points[i] = (float)(int32_t)value[i & 1] / POINT_SCALE;
+	}
+	*offset = pos;
+	return i / 2;
+}
+
+// Gives every distinct color and width one palette entry
+static void note_strokes_index_styles(note_strokes_t *strokes, const float *widths,
+				      const char *colors, note_arena_t *arena)
+{
+	size_t curves = strokes->curves_length;
+	gint64 *keys = malloc((curves + 1) * sizeof(*keys));
+	unsigned int *styles = note_arena_alloc(arena, (curves + 1) * sizeof(*styles));
+	GHashTable *indices = g_hash_table_new(g_int64_hash, g_int64_equal);
+
+	note_stroke_style_t *palette = 0;
+	size_t palette_length = 0, capacity = 0;
+	for (size_t i = 0; i < curves; i++) {
+		note_stroke_style_t style;
+		memcpy(style.color, &colors[i * 4], sizeof(style.color));
+		memcpy(&style.width, &widths[i], sizeof(style.width));
+
+		uint32_t color, width;
+		memcpy(&color, style.color, sizeof(color));
+		memcpy(&width, &style.width, sizeof(width));
+		keys[i] = (gint64)((uint64_t)width << 32 | color);
+
+		gpointer index = g_hash_table_lookup(indices, &keys[i]);
+		if (!index) {
+			palette = array_reserve(palette, palette_length, &capacity,
+						sizeof(*palette));
+			palette[palette_length++] = style;
+			index = GSIZE_TO_POINTER(palette_length);
+			g_hash_table_insert(indices, &keys[i], index);
+		}
+		styles[i] = GPOINTER_TO_SIZE(index) - 1;
+	}
+
+	g_hash_table_destroy(indices);
+	free(keys);
+	strokes->styles = styles;
+	strokes->palette = note_arena_adopt(arena, palette, palette_length * sizeof(*palette));
+	strokes->palette_length = palette_length;
+}
+
+static void note_strokes_measure(note_strokes_t *strokes)
+{
+	strokes->max_points = 0;
+	for (size_t i = 0; i < strokes->curves_length; i++)
+		if (strokes->num_points[i] > strokes->max_points)
+			strokes->max_points = strokes->num_points[i];
+}
+
+static const note_stroke_style_t *note_curve_style(const note_strokes_t *strokes,
+						    unsigned int curve)
+{
+	return &strokes->palette[strokes->styles[curve]];
+}
+
+// Encodes the arrays, Session.plist is released after compiling
+static void note_strokes_load(note_plist_t *plist, note_strokes_t *strokes, note_arena_t *arena)
+{
+	memset(strokes, 0, sizeof(*strokes));
+
+	plist_ref_t overlay = plist_handwriting_overlay(plist);
+	if (!overlay)
+		return;
+
+	size_t points_length = 0, num_points_length = 0, widths_length = 0, colors_length = 0;
+	const float *points = plist_dict_get_data(plist, overlay, "curvespoints", &points_length);
+	const unsigned int *num_points =
+		plist_dict_get_data(plist, overlay, "curvesnumpoints", &num_points_length);
+	const float *widths = plist_dict_get_data(plist, overlay, "curveswidth", &widths_length);
+	const char *colors = plist_dict_get_data(plist, overlay, "curvescolors", &colors_length);
+
+	// Arrays are empty if no lines have been drawn - that's okay!
+	if (!points || !points_length || !num_points || !num_points_length || !widths ||
+	    !widths_length || !colors || !colors_length)
+		return;
+
+	size_t curves_length = num_points_length / sizeof(*num_points);
+	if (widths_length / sizeof(*widths) < curves_length ||
+	    colors_length / 4 < curves_length) {
+		fprintf(stderr, "Inconsistent curve arrays, please report\n");
+		return;
+	}
+
+	// Also aligns them, data objects aren't padded in the plist
+	strokes->curves_length = curves_length;
+	strokes->num_points =
+		note_arena_copy(arena, num_points, curves_length * sizeof(*num_points));
+	note_strokes_encode(strokes, points, points_length / sizeof(*points), arena);
+	note_strokes_index_styles(strokes, widths, colors, arena);
+	note_strokes_measure(strokes);
+}
+
+static void note_model_extract_range(note_plist_t *plist, int range, int *start, int *end)
+{
+	const char *range_string = 0;
+	size_t range_length = 0;
+	plist_access(plist, 3, range, &range_string, &range_length);
+	if (!range_string) {
+		*start = *end = 0;
+		return;
+	}
+	float start_float, end_float;
+	plist_string_to_floats(range_string, &start_float, &end_float);
+	*start = (int)start_float;
+	*end = *start + (int)end_float;
+}
+
+static void note_model_extract_font(note_plist_t *plist, int font, const char **font_name,
+				    int *font_size)
+{
+	double floating_font_size = 0;
+	plist_ref_t font_keys = plist_access(plist, 2, font, "NS.keys");
+	uint64_t font_keys_length = plist_array_size(plist, font_keys);
+	int font_index = 0;
+	for (uint64_t i = 0; i < font_keys_length; i++) {
+		size_t key_index = plist_uint(plist, plist_array_item(plist, font_keys, i));
+
+		const char *key = 0;
+		size_t key_length = 0;
+		plist_access(plist, 3, key_index, &key, &key_length);
+		if (!key)
+			continue;
+
+		if (!memcmp(key, "NSFontSizeAttribute", key_length)) {
+			plist_access(plist, 4, font, "NS.objects", font_index,
+				     &floating_font_size);
+		} else if (!memcmp(key, "NSFontNameAttribute", key_length)) {
+			size_t font_length; // Decoded strings are 0-terminated
+			plist_access(plist, 5, font, "NS.objects", font_index, font_name,
+				     &font_length);
+		} else {
+			fprintf(stderr, "Unknown font attribute '%.*s', please report\n",
+				(int)key_length, key);
+		}
+
+		font_index++;
+	}
+
+	*font_size = (int)floating_font_size;
+}
+
+static void note_model_extract_color(note_plist_t *plist, int color, double *red,
+				     double *green, double *blue, double *alpha)
+{
+	plist_access(plist, 3, color, "UIRed", red);
+	plist_access(plist, 3, color, "UIGreen", green);
+	plist_access(plist, 3, color, "UIBlue", blue);
+	plist_access(plist, 3, color, "UIAlpha", alpha);
+}
+
+static void note_model_compile_text_run(note_compiler_t *compiler, size_t elem_index,
+					size_t text_length)
+{
+	note_plist_t *plist = compiler->plist;
+
+	plist_ref_t keys = plist_access(plist, 2, elem_index, "NS.keys");
+	if (plist_type(plist, keys) != PLIST_ARRAY)
+		return;
+	plist_ref_t values = plist_access(plist, 2, elem_index, "NS.objects");
+
+	int range = -1, font = -1, other_attributes = -1, color = -1;
+
+	int index = 0;
+	uint64_t keys_length = plist_array_size(plist, keys);
+	for (uint64_t i = 0; i < keys_length; i++) {
+		size_t key_index = plist_uint(plist, plist_array_item(plist, keys, i));
+
+		const char *key = 0;
+		size_t key_length = 0;
+		plist_access(plist, 3, key_index, &key, &key_length);
+		if (!key)
+			continue;
+
+		// The UID is the index in $objects, no need to decode the object itself
+		int object_index = plist_uint(plist, plist_array_item(plist, values, index++));
+
+		if (!memcmp(key, "subRangeColorCrossPlatformKey", key_length))
+			continue; // Seems irrelevant (always like "0.0,0.0,0.0,1.0")
+		else if (!memcmp(key, "subRangeRangeKey", key_length))
+			range = object_index;
+		else if (!memcmp(key, "subRangeFontKey", key_length))
+			font = object_index;
+		else if (!memcmp(key, "subRangeOtherAttributesKey", key_length))
+			other_attributes = object_index;
+		else if (!memcmp(key, "subRangeColorKey", key_length))
+			color = object_index;
+		else
+			fprintf(stderr, "Unknown text sub range key '%.*s', please report\n",
+				(int)key_length, key);
+	}
+
+	if (range < 0)
+		return;
+
+	int start, end;
+	note_model_extract_range(plist, range, &start, &end);
+	if (start < 0 || end > (int)text_length || start > end) {
+		fprintf(stderr, "Invalid text sub range %d-%d, please report\n", start, end);
+		return;
+	}
+
+	const char *font_name = 0;
+	int font_size = 0;
+	if (font >= 0)
+		note_model_extract_font(plist, font, &font_name, &font_size);
+
+	// TODO: Extract line-spacing, boldness, underline, etc. from other_attributes
+	(void)other_attributes;
+
+	double red = 0, green = 0, blue = 0, alpha = 1;
+	if (color >= 0)
+		note_model_extract_color(plist, color, &red, &green, &blue, &alpha);
+
+	note_model_t *model = compiler->model;
+	model->runs = array_reserve(model->runs, model->runs_length, &compiler->runs_capacity,
+				    sizeof(*model->runs));
+	note_text_run_t *run = &model->runs[model->runs_length++];
+	run->start = start;
+	run->end = end;
+	run->font = note_model_add_font(compiler, font_name);
+	run->font_size = font_size;
+	run->red = red;
+	run->green = green;
+	run->blue = blue;
+	run->alpha = alpha;
+}
+
+// Returns index of the compiled block or -1
+static int note_model_compile_text_store(note_compiler_t *compiler, int index)
+{
+	note_plist_t *plist = compiler->plist;
+	note_model_t *model = compiler->model;
+
+	const char *data = 0;
+	size_t data_length = 0;
+	plist_access(plist, 8, index, "NBAttributedBackingString", // TODO: Don't assume 0/1?
+		     "NBAttributedBackingStringCodingKey", "NS.objects", 0, "NS.bytes", &data,
+		     &data_length);
+	if (!data || !data_length)
+		return -1;
+
+	plist_ref_t array =
+		plist_access(plist, 6, index, "NBAttributedBackingString",
+			     "NBAttributedBackingStringCodingKey", "NS.objects", 1, "NS.objects");
+	if (plist_type(plist, array) != PLIST_ARRAY)
+		return -1;
+
+	size_t runs = model->runs_length;
+
+	uint64_t array_length = plist_array_size(plist, array);
+	for (uint64_t i = 0; i < array_length; i++) {
+		size_t elem_index = plist_uint(plist, plist_array_item(plist, array, i));
+		note_model_compile_text_run(compiler, elem_index, data_length);
+	}
+
+	model->blocks = array_reserve(model->blocks, model->blocks_length,
+				      &compiler->blocks_capacity, sizeof(*model->blocks));
+	note_text_block_t *block = &model->blocks[model->blocks_length];
+	block->text = note_model_add_string(compiler, data, data_length);
+	block->text_length = data_length;
+	block->runs = runs;
+	block->runs_length = model->runs_length - runs;
+	return model->blocks_length++;
+}
+
+// Returns 0 if the object can't be rendered
+static int note_model_compile_object(note_compiler_t *compiler, int index, note_object_t *object)
+{
+	note_plist_t *plist = compiler->plist;
+
+	const char *class = 0;
+	size_t class_length = 0;
+	plist_access(plist, 5, index, "$class", "$classname", &class, &class_length);
+	if (!class)
+		return 0;
+
+	if (!memcmp(class, "ImageMediaObject", class_length)) {
+		object->type = NOTE_OBJECT_IMAGE;
+	} else if (!memcmp(class, "TextBlockMediaObject", class_length)) {
+		object->type = NOTE_OBJECT_TEXT;
+	} else {
+		fprintf(stderr, "Unknown media object type '%.*s', please report\n",
+			(int)class_length, class);
+		return 0;
+	}
+
+	const char *position = 0;
+	size_t position_length = 0;
+	plist_access(plist, 4, index, "documentContentOrigin", &position, &position_length);
+	const char *size = 0;
+	size_t size_length = 0;
+	plist_access(plist, 4, index, "unscaledContentSize", &size, &size_length);
+	if (!position || !size)
+		return 0;
+
+	plist_string_to_floats(position, &object->x, &object->y);
+	plist_string_to_floats(size, &object->width, &object->height);
+
+	if (object->type == NOTE_OBJECT_TEXT) {
+		// Only the UID is needed, the text store is compiled from $objects
+		plist_ref_t text_store = plist_access(plist, 1, index);
+		text_store = plist_dict_item(plist, text_store, "textStore");
+		if (plist_type(plist, text_store) != PLIST_UID)
+			return 0;
+		object->block =
+			note_model_compile_text_store(compiler, plist_uint(plist, text_store));
+		return object->block >= 0;
+	}
+
+	char missing = 0;
+	plist_access(plist, 6, index, "figure", "FigureBackgroundObjectKey",
+		     "kImageObjectSnapshotKey", "imageIsMissing", &missing);
+	if (missing)
+		return 0;
+
+	const char *path = 0;
+	size_t path_length = 0;
+	plist_access(plist, 7, index, "figure", "FigureBackgroundObjectKey",
+		     "kImageObjectSnapshotKey", "relativePath", &path, &path_length);
+	if (!path)
+		return 0;
+	object->path = note_model_add_string(compiler, path, path_length);
+
+	object->is_jpeg = 0;
+	plist_access(plist, 6, index, "figure", "FigureBackgroundObjectKey",
+		     "kImageObjectSnapshotKey", "saveAsJPEG", &object->is_jpeg);
+	object->block = -1;
+	return 1;
+}
+
+static void note_model_compile_objects(note_compiler_t *compiler, plist_ref_t objects_array)
+{
+	note_plist_t *plist = compiler->plist;
+	note_model_t *model = compiler->model;
+
+	uint64_t objects_length = plist_array_size(plist, objects_array);
+	for (uint64_t i = 0; i < objects_length; i++) {
+		size_t index = plist_uint(plist, plist_array_item(plist, objects_array, i));
+
+		model->objects =
+			array_reserve(model->objects, model->objects_length,
+				      &compiler->objects_capacity, sizeof(*model->objects));
+		note_object_t *object = &model->objects[model->objects_length];
+		if (note_model_compile_object(compiler, index, object))
+			model->objects_length++;
+	}
+}
+
+// Resolves everything rendering needs once, so the render path never touches the plist
+// It doesn't really matter if something in here fails
+static void note_model_compile(note_plist_t *plist, note_model_t *model, note_arena_t *arena)
+{
+	memset(model, 0, sizeof(*model));
+
+	note_compiler_t compiler = { 0 };
+	compiler.plist = plist;
+	compiler.model = model;
+	compiler.fonts = g_hash_table_new(g_str_hash, g_str_equal);
+
+	// The global text object
+	model->global_block =
+		note_model_compile_text_store(&compiler, SESSION_OBJECTS_GLOBAL_TEXT_STORE);
+
+	plist_ref_t objects_array = plist_access(plist, 3, SESSION_OBJECTS_GLOBAL_TEXT_STORE,
+						 "mediaObjects", "NS.objects");
+
+	if (plist_type(plist, objects_array) == PLIST_ARRAY)
+		note_model_compile_objects(&compiler, objects_array);
+
+	note_strokes_load(plist, &model->strokes, arena);
+
+	g_hash_table_destroy(compiler.fonts);
+
+	model->objects = note_arena_adopt(arena, model->objects,
+					  model->objects_length * sizeof(*model->objects));
+	model->blocks = note_arena_adopt(arena, model->blocks,
+					 model->blocks_length * sizeof(*model->blocks));
+	model->runs =
+		note_arena_adopt(arena, model->runs, model->runs_length * sizeof(*model->runs));
+	model->strings = note_arena_adopt(arena, model->strings, model->strings_length);
+}
+
+// Unwrapped layouts have one line per paragraph, so their line count is known
+// without shaping (Pango splits paragraphs at \n, \r, \r\n and U+2029)
+static int note_text_line_count(const char *text, size_t length)
+{
+	int lines = 1;
+	for (size_t i = 0; i < length; i++) {
+		if (text[i] == '\n') {
+			lines++;
+		} else if (text[i] == '\r') {
+			lines++;
+			if (i + 1 < length && text[i + 1] == '\n')
+				i++;
+		} else if (i + 2 < length && !memcmp(&text[i], "\xe2\x80\xa9", 3)) {
+			lines++;
+			i += 2;
+		}
+	}
+	return lines;
+}
+
+// Height a run advances the text by, nothing else may be used for positioning runs
+// (except for the wrapped global text store of reflowable documents, see note_document_reflow)
+static int note_text_run_height(const char *text, const note_text_run_t *run)
+{
+	return note_text_line_count(text + run->start, run->end - run->start) * run->font_size;
+}
+
+/**
+ * Stroke index
+ */
+
+// TODO: Find more elegant solution for page count (there doesn't seem to be)
+static int note_page_count(const note_strokes_t *strokes, double page_height)
+{
+	float bottom = 0;
+	for (size_t i = 0; i < strokes->curves_length; i++)
+		if (strokes->bounds[i].y2 > bottom)
+			bottom = strokes->bounds[i].y2;
+	return (int)(bottom / page_height) + 1;
+}
+
+// Bounds of a curve including its line width, lines reach half their width beyond the points
+static note_bounds_t note_curve_bounds(const note_strokes_t *strokes, unsigned int curve)
+{
+	note_bounds_t bounds = strokes->bounds[curve];
+	if (bounds.y1 > bounds.y2) // Empty, touches no page
+		return bounds;
+
+	float extent = note_curve_style(strokes, curve)->width / 2;
+	bounds.x1 -= extent;
+	bounds.y1 -= extent;
+	bounds.x2 += extent;
+	bounds.y2 += extent;
+	return bounds;
+}
+
+// Range of pages the y range of a curve touches
+static void note_curve_pages(float min, float max, double height, int page_count, int *first,
+			     int *last)
+{
+	*first = min < 0 ? 0 : (int)(min / height);
+	*last = max < 0 ? -1 : (int)(max / height);
+	if (*last >= page_count)
+		*last = page_count - 1;
+}
+
+// Douglas-Peucker tolerances of the levels of detail in document units
+static const float lod_tolerances[LOD_LEVELS] = { 0, 0.2, 1, 4 };
+
+// Marks the points of a curve needed at tolerance (Douglas-Peucker), returns their count
+// stack needs room for 2 * length elements
+static size_t note_curve_simplify(const float *points, size_t length, float tolerance, char *keep,
+				  size_t *stack)
+{
+	memset(keep, 0, length);
+	keep[0] = keep[length - 1] = 1;
+	size_t kept = length > 1 ? 2 : 1;
+
+	size_t top = 0;
+	if (length > 2) {
+		stack[top++] = 0;
+		stack[top++] = length - 1;
+	}
+
+	while (top) {
+		size_t last = stack[--top], first = stack[--top];
+		float ax = points[first * 2], ay = points[first * 2 + 1];
+		float dx = points[last * 2] - ax, dy = points[last * 2 + 1] - ay;
+		float norm = dx * dx + dy * dy;
+
+		// Farthest point from the line between first and last (squared distances)
+		float max = 0;
+		size_t farthest = first;
+		for (size_t i = first + 1; i < last; i++) {
+			float px = points[i * 2] - ax, py = points[i * 2 + 1] - ay;
+			float cross = px * dy - py * dx;
+			float distance = norm > 0 ? cross * cross / norm : px * px + py * py;
+			if (distance > max) {
+				max = distance;
+				farthest = i;
+			}
+		}
+
+		if (max <= tolerance * tolerance)
+			continue;
+
+		keep[farthest] = 1;
+		kept++;
+		if (farthest - first > 1) {
+			stack[top++] = first;
+			stack[top++] = farthest;
+		}
+		if (last - farthest > 1) {
+			stack[top++] = farthest;
+			stack[top++] = last;
+		}
+	}
+
+	return kept;
+}
+
+// Precomputes the simplified curves of every level of detail
+static void note_document_simplify_strokes(note_document_t *note_document)
+{
+	const note_strokes_t *strokes = &note_document->model.strokes;
+	size_t curves = strokes->curves_length;
+	size_t max_length = (size_t)strokes->max_points + 1;
+
+	float *curve = malloc(2 * max_length * sizeof(*curve));
+	char *keep = malloc(max_length);
+	size_t *stack = malloc(2 * max_length * sizeof(*stack));
+
+	unsigned int *offsets = note_arena_alloc(&note_document->arena, (LOD_LEVELS - 1) *
+							       (curves + 1) * sizeof(*offsets));
+
+	// Every curve is decoded once for all levels, their points are joined in the end
+	unsigned int *levels[LOD_LEVELS - 1] = { 0 };
+	size_t lengths[LOD_LEVELS - 1] = { 0 }, capacities[LOD_LEVELS - 1] = { 0 };
+	size_t pos = 0;
+	for (size_t i = 0; i < curves; i++) {
+		for (int level = 1; level < LOD_LEVELS; level++)
+			offsets[(level - 1) * (curves + 1) + i] = lengths[level - 1];
+
+		unsigned int curve_length =
+			note_curve_decode(strokes, &pos, strokes->num_points[i], curve);
+		if (!curve_length || curve_length < strokes->num_points[i])
+			continue;
+
+		for (int level = 1; level < LOD_LEVELS; level++) {
+			note_curve_simplify(curve, curve_length, lod_tolerances[level], keep,
+					    stack);
+			unsigned int **points = &levels[level - 1];
+			size_t *length = &lengths[level - 1];
+			for (size_t j = 0; j < curve_length; j++) {
+				if (!keep[j])
+					continue;
+				*points = array_reserve(*points, *length, &capacities[level - 1],
+							sizeof(**points));
+				(*points)[(*length)++] = j;
+			}
+		}
+	}
+
+	size_t length = 0;
+	for (int level = 1; level < LOD_LEVELS; level++) {
+		unsigned int *level_offsets = &offsets[(level - 1) * (curves + 1)];
+		for (size_t i = 0; i < curves; i++)
+			level_offsets[i] += length;
+		length += lengths[level - 1];
+		level_offsets[curves] = length;
+	}
+
+	unsigned int *points =
+		note_arena_alloc(&note_document->arena, (length + 1) * sizeof(*points));
+	for (int level = 1; level < LOD_LEVELS; level++) {
+		unsigned int *level_points = &points[offsets[(level - 1) * (curves + 1)]];
+		if (lengths[level - 1])
+			memcpy(level_points, levels[level - 1],
+			       lengths[level - 1] * sizeof(*points));
+		free(levels[level - 1]);
+	}
+
+	free(stack);
+	free(keep);
+	free(curve);
+
+	note_document->lod_offsets = offsets;
+	note_document->lod_points = points;
+}
+
+// Buckets the curves by the pages their bounds touch, so rendering a page only looks at its
+// own curves. The bounds are known since compiling, nothing is decoded here
+static void note_document_index_strokes(note_document_t *note_document)
+{
+	const note_strokes_t *strokes = &note_document->model.strokes;
+	size_t curves = strokes->curves_length;
+	double height = note_document->height;
+	note_arena_t *arena = &note_document->arena;
+	int page_count = note_document->page_count;
+
+	// Count curves per page, then place them (counting sort keeps drawing order)
+	size_t page_curves_size = (page_count + 1) * sizeof(unsigned int);
+	unsigned int *page_curves = note_arena_alloc(arena, page_curves_size);
+	memset(page_curves, 0, page_curves_size);
+	int first, last;
+	for (size_t i = 0; i < curves; i++) {
+		note_bounds_t bounds = note_curve_bounds(strokes, i);
+		note_curve_pages(bounds.y1, bounds.y2, height, page_count, &first, &last);
+		for (int page = first; page <= last; page++)
+			page_curves[page + 1]++;
+	}
+
+	for (int i = 0; i < page_count; i++)
+		page_curves[i + 1] += page_curves[i];
+
+	note_curve_ref_t *curve_refs =
+		note_arena_alloc(arena, (page_curves[page_count] + 1) * sizeof(*curve_refs));
+	unsigned int *fill = malloc(page_count * sizeof(*fill));
+	memcpy(fill, page_curves, page_count * sizeof(*fill));
+
+	for (size_t i = 0; i < curves; i++) {
+		note_bounds_t bounds = note_curve_bounds(strokes, i);
+		note_curve_pages(bounds.y1, bounds.y2, height, page_count, &first, &last);
+		for (int page = first; page <= last; page++) {
+			note_curve_ref_t *ref = &curve_refs[fill[page]++];
+			ref->curve = i;
+			ref->offset = strokes->offsets[i];
+		}
+	}
+
+	free(fill);
+	note_document_simplify_strokes(note_document);
+	note_document->curve_refs = curve_refs;
+	note_document->page_curves = page_curves;
+}
+
+// Whether an object lies on the page, objects crossing page borders aren't drawn
+static int note_object_on_page(const note_object_t *object, double start, double end)
+{
+	return object->y >= start && object->y + object->height <= end;
+}
+
+// Buckets the media objects by the page they lie on (in drawing order), so rendering a
+// page only looks at its own objects
+static void note_document_index_objects(note_document_t *note_document)
+{
+	const note_model_t *model = &note_document->model;
+	int page_count = note_document->page_count;
+	double height = note_document->height;
+	note_arena_t *arena = &note_document->arena;
+
+	// Page of every object, -1 if it isn't drawn anywhere
+	int *pages = malloc((model->objects_length + 1) * sizeof(*pages));
+	size_t page_objects_size = (page_count + 1) * sizeof(unsigned int);
+	unsigned int *page_objects = note_arena_alloc(arena, page_objects_size);
+	memset(page_objects, 0, page_objects_size);
+	for (size_t i = 0; i < model->objects_length; i++) {
+		const note_object_t *object = &model->objects[i];
+		double page = floor(object->y / height);
+		pages[i] = page >= 0 && page < page_count ? (int)page : -1;
+		if (pages[i] >= 0 &&
+		    !note_object_on_page(object, pages[i] * height, (pages[i] + 1) * height))
+			pages[i] = -1;
+		if (pages[i] >= 0)
+			page_objects[pages[i] + 1]++;
+	}
+
+	for (int i = 0; i < page_count; i++)
+		page_objects[i + 1] += page_objects[i];
+
+	unsigned int *object_refs =
+		note_arena_alloc(arena, (page_objects[page_count] + 1) * sizeof(*object_refs));
+	unsigned int *fill = malloc(page_count * sizeof(*fill));
+	memcpy(fill, page_objects, page_count * sizeof(*fill));
+	for (size_t i = 0; i < model->objects_length; i++)
+		if (pages[i] >= 0)
+			object_refs[fill[pages[i]]++] = i;
+
+	free(fill);
+	free(pages);
+	note_document->object_refs = object_refs;
+	note_document->page_objects = page_objects;
+}
+
+// The global text store is one long column of runs starting at the top of the first
+// page, each as high as its lines (see note_page_render_text_run)
+static void note_document_paginate_text(note_document_t *note_document)
+{
+	const note_model_t *model = &note_document->model;
+	size_t length =
+		model->global_block >= 0 ? model->blocks[model->global_block].runs_length : 0;
+	note_arena_t *arena = &note_document->arena;
+	note_document->run_y = note_arena_alloc(arena, (length + 1) * sizeof(float));
+	note_document->run_max_end = note_arena_alloc(arena, (length + 1) * sizeof(float));
+	note_document->run_y[0] = 0;
+	if (!length)
+		return;
+
+	const note_text_block_t *block = &model->blocks[model->global_block];
+	const char *text = &model->strings[block->text];
+	float y = 0, max_end = 0;
+	for (size_t i = 0; i < length; i++) {
+		const note_text_run_t *run = &model->runs[block->runs + i];
+		int height = note_document->reflowable ?
+				     (int)note_document->run_lines[i] * run->font_size :
+				     note_text_run_height(text, run);
+
+		// Drawn half a line lower, and Pango's lines are a bit higher than the font size
+		float end = y + run->font_size / 2 + height * TEXT_LINE_HEIGHT;
+		max_end = end > max_end ? end : max_end;
+
+		note_document->run_y[i] = y;
+		note_document->run_max_end[i] = max_end;
+		y += height;
+	}
+	note_document->run_y[length] = y; // Where the text ends
+}
+
+// First run of the global text store that may reach below top, by binary search
+static size_t note_document_first_run(const note_document_t *note_document, float top)
+{
+	const note_model_t *model = &note_document->model;
+	size_t low = 0, high = model->blocks[model->global_block].runs_length;
+	while (low < high) {
+		size_t middle = low + (high - low) / 2;
+		if (note_document->run_max_end[middle] < top)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	return low;
+}
+
+// Builds the stroke index on the first render, so opening doesn't pay for it
+static void note_document_prepare(note_document_t *note_document)
+{
+	g_mutex_lock(&note_document->index_lock);
+	if (!note_document->curve_refs)
+		note_document_index_strokes(note_document);
+	if (!note_document->page_objects)
+		note_document_index_objects(note_document);
+	if (!note_document->run_y)
+		note_document_paginate_text(note_document);
+	g_mutex_unlock(&note_document->index_lock);
+}
+
+/**
+ * Reflow
+ */
+
+// Line breaks of an earlier layout at another width, the runs that didn't wrap at it
+// and don't at the new width keep their lines
+typedef struct {
+	float width; // 0 if there's no earlier layout
+	const unsigned int *lines;
+	const float *widths;
+} note_reflow_hint_t;
+
+static size_t note_reflow_length(const note_document_t *note_document)
+{
+	const note_model_t *model = &note_document->model;
+	if (!note_document->reflowable || model->global_block < 0)
+		return 0;
+	return model->blocks[model->global_block].runs_length;
+}
+
+// Breaks the lines of the global text store at the page width once while opening, the
+// index cache keeps them. Media objects stay where they are, they're anchored to the
+// page and not to the text. Only runs wider than the narrower of the two widths are
+// shaped again if there's a hint, which are usually just the long paragraphs.
+static void note_document_reflow(note_document_t *note_document, const note_reflow_hint_t *hint,
+				 note_profile_t *profile)
+{
+	const note_model_t *model = &note_document->model;
+	size_t length = note_reflow_length(note_document);
+	note_arena_t *arena = &note_document->arena;
+	note_document->run_lines = note_arena_alloc(arena, (length + 1) * sizeof(unsigned int));
+	note_document->run_widths = note_arena_alloc(arena, (length + 1) * sizeof(float));
+	if (!length)
+		return;
+
+	note_profile_begin(profile, NOTE_PHASE_REFLOW);
+
+	// The document's text cache is sized by the page count, which depends on this
+	note_text_cache_t measure;
+	note_text_cache_init(&measure, 0, 0);
+	note_text_cache_default_options(&measure);
+
+	const note_text_block_t *block = &model->blocks[model->global_block];
+	const char *text = &model->strings[block->text];
+	float width = note_document->width;
+	float narrower = hint->width < width ? hint->width : width;
+	size_t reflowed = 0;
+	for (size_t i = 0; i < length; i++) {
+		if (hint->width && hint->widths[i] <= narrower) {
+			note_document->run_lines[i] = hint->lines[i];
+			note_document->run_widths[i] = hint->widths[i];
+			continue;
+		}
+
+		const note_text_run_t *run = &model->runs[block->runs + i];
+		PangoLayout *layout = pango_layout_new(measure.context);
+		PangoFontDescription *font = note_text_cache_font(&measure, model, run);
+		pango_layout_set_font_description(layout, font);
+		pango_layout_set_text(layout, text + run->start, run->end - run->start);
+
+		int natural;
+		pango_layout_get_size(layout, &natural, 0);
+		note_document->run_widths[i] = (float)natural / PANGO_SCALE;
+		if (note_document->run_widths[i] > width)
+			note_text_wrap(layout, width);
+		note_document->run_lines[i] = pango_layout_get_line_count(layout);
+		g_object_unref(layout);
+		reflowed++;
+	}
+
+	note_text_cache_clear(&measure);
+	note_profile_count(profile, NOTE_COUNTER_RUNS_REFLOWED, reflowed);
+	note_profile_end(profile, NOTE_PHASE_REFLOW);
+}
+
+/**
+ * Index cache
+ */
+
+// Bump when any struct in the cache changes
+#define INDEX_CACHE_VERSION 9
+#define INDEX_CACHE_BYTE_ORDER 0x01020304
+#define INDEX_CACHE_ALIGN 8
+
+enum {
+	INDEX_CACHE_OBJECTS,
+	INDEX_CACHE_BLOCKS,
+	INDEX_CACHE_RUNS,
+	INDEX_CACHE_STRINGS,
+	INDEX_CACHE_POINTS,
+	INDEX_CACHE_NUM_POINTS,
+	INDEX_CACHE_STYLES,
+	INDEX_CACHE_PALETTE,
+	INDEX_CACHE_CURVE_OFFSETS,
+	INDEX_CACHE_CURVE_BOUNDS,
+	INDEX_CACHE_CURVE_REFS,
+	INDEX_CACHE_PAGE_CURVES,
+	INDEX_CACHE_LOD_OFFSETS,
+	INDEX_CACHE_LOD_POINTS,
+	INDEX_CACHE_OBJECT_REFS,
+	INDEX_CACHE_PAGE_OBJECTS,
+	INDEX_CACHE_RUN_LINES,
+	INDEX_CACHE_RUN_WIDTHS,
+	INDEX_CACHE_SECTIONS,
+};
+
+// Start of the cache file, followed by the aligned sections
+typedef struct {
+	char magic[8];
+	uint32_t version, byte_order;
+	// Of Session.plist, the cache is stale if any of these differ
+	uint32_t crc, reserved;
+	int64_t size;
+
+	double width, height;
+	int32_t page_count, global_block;
+	int32_t reflowable; // Reflowed at width if set
+	uint32_t built; // Parts of the index in the sections, see note_cache_built
+	uint64_t sections[INDEX_CACHE_SECTIONS][2]; // Offset and length in bytes
+} note_cache_header_t;
+
+static const char note_cache_magic[8] = "ZNINDEX";
+
+// Cache file of a document is named by the hash of its absolute path
+static char *note_cache_path(const char *path)
+{
+	const char *dir = g_getenv("ZATHURA_NOTE_CACHE_DIR");
+	char *cache_dir = dir && *dir ? g_strdup(dir) :
+					g_build_filename(g_get_user_cache_dir(), "zathura-note",
+							 NULL);
+
+	char *absolute = realpath(path, NULL);
+	char *hash = g_compute_checksum_for_string(G_CHECKSUM_SHA1, absolute ? absolute : path,
+						   -1);
+	char *name = g_strdup_printf("%s.index", hash);
+	char *cache_path = g_build_filename(cache_dir, name, NULL);
+
+	g_free(name);
+	g_free(hash);
+	free(absolute);
+	g_free(cache_dir);
+	return cache_path;
+}
+
+// The model and index only depend on Session.plist, so syncs that just touch other
+// entries or the .note file itself keep the cache valid
+static int note_cache_key(note_document_t *note_document, const char *path)
+{
+	if (!env_flag_default("ZATHURA_NOTE_CACHE", 1) || !note_document->session_crc)
+		return 0;
+
+	note_document->cache_path = note_cache_path(path);
+	return 1;
+}
+
+static void note_cache_sections(note_document_t *note_document, void **data[INDEX_CACHE_SECTIONS],
+				size_t sizes[INDEX_CACHE_SECTIONS])
+{
+	note_model_t *model = &note_document->model;
+	note_strokes_t *strokes = &model->strokes;
+
+#define SECTION(id, pointer, size)                \
+	do {                                      \
+		data[id] = (void **)&(pointer);   \
+		sizes[id] = size;                 \
+	} while (0)
+	SECTION(INDEX_CACHE_OBJECTS, model->objects, sizeof(*model->objects));
+	SECTION(INDEX_CACHE_BLOCKS, model->blocks, sizeof(*model->blocks));
+	SECTION(INDEX_CACHE_RUNS, model->runs, sizeof(*model->runs));
+	SECTION(INDEX_CACHE_STRINGS, model->strings, 1);
+	SECTION(INDEX_CACHE_POINTS, strokes->points, sizeof(*strokes->points));
+	SECTION(INDEX_CACHE_NUM_POINTS, strokes->num_points, sizeof(*strokes->num_points));
+	SECTION(INDEX_CACHE_STYLES, strokes->styles, sizeof(*strokes->styles));
+	SECTION(INDEX_CACHE_PALETTE, strokes->palette, sizeof(*strokes->palette));
+	SECTION(INDEX_CACHE_CURVE_OFFSETS, strokes->offsets, sizeof(*strokes->offsets));
+	SECTION(INDEX_CACHE_CURVE_BOUNDS, strokes->bounds, sizeof(*strokes->bounds));
+	SECTION(INDEX_CACHE_CURVE_REFS, note_document->curve_refs,
+		sizeof(*note_document->curve_refs));
+	SECTION(INDEX_CACHE_PAGE_CURVES, note_document->page_curves,
+		sizeof(*note_document->page_curves));
+	SECTION(INDEX_CACHE_LOD_OFFSETS, note_document->lod_offsets,
+		sizeof(*note_document->lod_offsets));
+	SECTION(INDEX_CACHE_LOD_POINTS, note_document->lod_points,
+		sizeof(*note_document->lod_points));
+	SECTION(INDEX_CACHE_OBJECT_REFS, note_document->object_refs,
+		sizeof(*note_document->object_refs));
+	SECTION(INDEX_CACHE_PAGE_OBJECTS, note_document->page_objects,
+		sizeof(*note_document->page_objects));
+	SECTION(INDEX_CACHE_RUN_LINES, note_document->run_lines,
+		sizeof(*note_document->run_lines));
+	SECTION(INDEX_CACHE_RUN_WIDTHS, note_document->run_widths,
+		sizeof(*note_document->run_widths));
+#undef SECTION
+}
+
+// The index is built on the first render, a cache written before that only has the model
+enum {
+	INDEX_CACHE_BUILT_STROKES = 1, // Curve refs, LOD
+	INDEX_CACHE_BUILT_OBJECTS = 2, // Object refs
+	INDEX_CACHE_BUILT_ALL = 3,
+};
+
+static unsigned int note_cache_built(const note_document_t *note_document)
+{
+	return (note_document->curve_refs ? INDEX_CACHE_BUILT_STROKES : 0) |
+	       (note_document->page_objects ? INDEX_CACHE_BUILT_OBJECTS : 0);
+}
+
+// Part of the index a section belongs to, 0 for the model
+static unsigned int note_cache_section_part(int id)
+{
+	switch (id) {
+	case INDEX_CACHE_CURVE_REFS:
+	case INDEX_CACHE_PAGE_CURVES:
+	case INDEX_CACHE_LOD_OFFSETS:
+	case INDEX_CACHE_LOD_POINTS:
+		return INDEX_CACHE_BUILT_STROKES;
+	case INDEX_CACHE_OBJECT_REFS:
+	case INDEX_CACHE_PAGE_OBJECTS:
+		return INDEX_CACHE_BUILT_OBJECTS;
+	default:
+		return 0;
+	}
+}
 
-	if (length > closure->length)
-		return CAIRO_STATUS_READ_ERROR;
+// Number of elements of every section, the parts of the index that aren't built have none
+static void note_cache_lengths(note_document_t *note_document, unsigned int built,
+			       size_t lengths[INDEX_CACHE_SECTIONS])
+{
+	const note_model_t *model = &note_document->model;
+	int page_count = note_document->page_count;
+
+	lengths[INDEX_CACHE_OBJECTS] = model->objects_length;
+	lengths[INDEX_CACHE_BLOCKS] = model->blocks_length;
+	lengths[INDEX_CACHE_RUNS] = model->runs_length;
+	lengths[INDEX_CACHE_STRINGS] = model->strings_length;
+	lengths[INDEX_CACHE_POINTS] = model->strokes.points_length;
+	lengths[INDEX_CACHE_NUM_POINTS] = model->strokes.curves_length;
+	lengths[INDEX_CACHE_STYLES] = model->strokes.curves_length;
+	lengths[INDEX_CACHE_PALETTE] = model->strokes.palette_length;
+	lengths[INDEX_CACHE_CURVE_OFFSETS] = model->strokes.curves_length;
+	lengths[INDEX_CACHE_CURVE_BOUNDS] = model->strokes.curves_length;
+	lengths[INDEX_CACHE_RUN_LINES] = note_reflow_length(note_document);
+	lengths[INDEX_CACHE_RUN_WIDTHS] = note_reflow_length(note_document);
+	for (int i = 0; i < INDEX_CACHE_SECTIONS; i++)
+		if (note_cache_section_part(i))
+			lengths[i] = 0;
+
+	if (built & INDEX_CACHE_BUILT_STROKES) {
+		lengths[INDEX_CACHE_CURVE_REFS] = note_document->page_curves[page_count];
+		lengths[INDEX_CACHE_PAGE_CURVES] = page_count + 1;
+		lengths[INDEX_CACHE_LOD_OFFSETS] =
+			(LOD_LEVELS - 1) * (model->strokes.curves_length + 1);
+		lengths[INDEX_CACHE_LOD_POINTS] =
+			note_document->lod_offsets[lengths[INDEX_CACHE_LOD_OFFSETS] - 1];
+	}
+	if (built & INDEX_CACHE_BUILT_OBJECTS) {
+		lengths[INDEX_CACHE_OBJECT_REFS] = note_document->page_objects[page_count];
+		lengths[INDEX_CACHE_PAGE_OBJECTS] = page_count + 1;
+	}
+}
 
-	memcpy(buf, closure->data, length);
+// Row offsets of a CSR index have to grow and stay within the array they point into
+static int note_cache_check_offsets(const unsigned int *offsets, size_t length, size_t limit)
+{
+	for (size_t i = 0; i < length; i++)
+		if (offsets[i] > limit || (i && offsets[i] < offsets[i - 1]))
+			return 0;
+	return 1;
+}
 
-	closure->length -= length;
-	closure->data += length;
+// Every offset the model stores has to point into the section it's meant for, the
+// renderer trusts them. The strings end with a 0, names in there are terminated.
+static int note_cache_check_model(const note_model_t *model)
+{
+	size_t strings = model->strings_length;
+	if (!strings || model->strings[strings - 1])
+		return 0;
 
-	return CAIRO_STATUS_SUCCESS;
+	for (size_t i = 0; i < model->blocks_length; i++) {
+		const note_text_block_t *block = &model->blocks[i];
+		if (block->text >= strings || block->text_length >= strings - block->text ||
+		    block->runs > model->runs_length ||
+		    block->runs_length > model->runs_length - block->runs)
+			return 0;
+		for (unsigned int j = block->runs; j < block->runs + block->runs_length; j++) {
+			const note_text_run_t *run = &model->runs[j];
+			if (run->start > run->end || run->end > block->text_length)
+				return 0;
+		}
+	}
+	for (size_t i = 0; i < model->runs_length; i++)
+		if (model->runs[i].font >= strings)
+			return 0;
+
+	for (size_t i = 0; i < model->objects_length; i++) {
+		const note_object_t *object = &model->objects[i];
+		if (object->type == NOTE_OBJECT_IMAGE) {
+			if (object->path >= strings)
+				return 0;
+		} else if (object->type != NOTE_OBJECT_TEXT || object->block < -1 ||
+			   object->block >= (int)model->blocks_length) {
+			return 0;
+		}
+	}
+
+	const note_strokes_t *strokes = &model->strokes;
+	for (size_t i = 0; i < strokes->curves_length; i++)
+		if (strokes->styles[i] >= strokes->palette_length)
+			return 0;
+	return note_cache_check_offsets(strokes->offsets, strokes->curves_length,
+					strokes->points_length);
 }
 
-static cairo_surface_t *cairo_surface_scale(cairo_surface_t *surface, float width, float height)
+// The index refers to curves, points and objects of the model and to itself, lengths
+// are those of note_cache_lengths
+static int note_cache_check_index(const note_document_t *note_document, unsigned int built,
+				  const size_t lengths[INDEX_CACHE_SECTIONS])
 {
-	int unscaled_width = cairo_image_surface_get_width(surface);
-	int unscaled_height = cairo_image_surface_get_height(surface);
-	cairo_surface_t *result = cairo_surface_create_similar(
-		surface, cairo_surface_get_content(surface), width, height);
-	cairo_t *cairo = cairo_create(result);
-	cairo_scale(cairo, width / (float)unscaled_width, height / (float)unscaled_height);
-	cairo_set_source_surface(cairo, surface, 0, 0);
-	cairo_set_operator(cairo, CAIRO_OPERATOR_SOURCE);
-	cairo_paint(cairo);
-	cairo_destroy(cairo);
-	return result;
+	const note_model_t *model = &note_document->model;
+	const note_strokes_t *strokes = &model->strokes;
+	int page_count = note_document->page_count;
+
+	if ((built & INDEX_CACHE_BUILT_OBJECTS) &&
+	    !note_cache_check_offsets(note_document->page_objects, page_count + 1,
+				      lengths[INDEX_CACHE_OBJECT_REFS]))
+		return 0;
+	for (size_t i = 0; i < lengths[INDEX_CACHE_OBJECT_REFS]; i++)
+		if (note_document->object_refs[i] >= model->objects_length)
+			return 0;
+	if (!(built & INDEX_CACHE_BUILT_STROKES))
+		return 1;
+
+	for (size_t i = 0; i < lengths[INDEX_CACHE_CURVE_REFS]; i++) {
+		const note_curve_ref_t *ref = &note_document->curve_refs[i];
+		if (ref->curve >= strokes->curves_length || ref->offset > strokes->points_length)
+			return 0;
+	}
+	if (!note_cache_check_offsets(note_document->page_curves, page_count + 1,
+				      lengths[INDEX_CACHE_CURVE_REFS]))
+		return 0;
+
+	// Kept points are indices into their curve
+	size_t curves = strokes->curves_length;
+	const unsigned int *offsets = note_document->lod_offsets;
+	if (!note_cache_check_offsets(offsets, lengths[INDEX_CACHE_LOD_OFFSETS],
+				      lengths[INDEX_CACHE_LOD_POINTS]))
+		return 0;
+	for (int level = 1; level < LOD_LEVELS; level++, offsets += curves + 1)
+		for (size_t i = 0; i < curves; i++)
+			for (unsigned int j = offsets[i]; j < offsets[i + 1]; j++)
+				if (note_document->lod_points[j] >= strokes->num_points[i])
+					return 0;
+	return 1;
 }
 
-cairo_surface_t *cairo_image_surface_create_from_jpeg_mem(void *data, size_t len)
+// Maps the cached model and index, returns 0 on a miss or a stale cache
+// A cache that was only reflowed at another width leaves its line breaks in hint
+static int note_cache_load(note_document_t *note_document, note_reflow_hint_t *hint)
 {
-	struct jpeg_decompress_struct jpeg;
-	struct jpeg_error_mgr jpeg_err;
-	jpeg.err = jpeg_std_error(&jpeg_err);
-	jpeg_create_decompress(&jpeg);
-	jpeg_mem_src(&jpeg, data, len);
-	jpeg_read_header(&jpeg, TRUE);
+	int fd = open(note_document->cache_path, O_RDONLY);
+	if (fd < 0)
+		return 0;
 
-#ifdef LIBJPEG_TURBO_VERSION
-#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
-	jpeg.out_color_space = JCS_EXT_BGRA;
-#else
-	jpeg.out_color_space = JCS_EXT_ARGB;
-#endif
-#else
-	jpeg.out_color_space = JCS_RGB;
-#endif
+	struct stat cache_stat;
+	void *map = MAP_FAILED;
+	if (!fstat(fd, &cache_stat) && (size_t)cache_stat.st_size >= sizeof(note_cache_header_t))
+		map = mmap(0, cache_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return 0;
 
-	jpeg_start_decompress(&jpeg);
+	size_t map_length = cache_stat.st_size;
+	const note_cache_header_t *header = map;
+	if (memcmp(header->magic, note_cache_magic, sizeof(header->magic)) ||
+	    header->version != INDEX_CACHE_VERSION ||
+	    header->byte_order != INDEX_CACHE_BYTE_ORDER ||
+	    header->crc != note_document->session_crc ||
+	    header->size != (int64_t)note_document->session_size || header->page_count < 1 ||
+	    (header->built & ~INDEX_CACHE_BUILT_ALL))
+		goto stale;
+
+	void **data[INDEX_CACHE_SECTIONS];
+	size_t sizes[INDEX_CACHE_SECTIONS];
+	note_cache_sections(note_document, data, sizes);
+	for (int i = 0; i < INDEX_CACHE_SECTIONS; i++) {
+		uint64_t offset = header->sections[i][0], length = header->sections[i][1];
+		if (offset % INDEX_CACHE_ALIGN || offset > map_length ||
+		    length > map_length - offset || length % sizes[i])
+			goto stale;
+		*data[i] = (char *)map + offset;
+	}
 
-	cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_RGB24, jpeg.output_width,
-							      jpeg.output_height);
-	if (cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS) {
-		jpeg_destroy_decompress(&jpeg);
-		return surface;
+	note_document->width = header->width;
+	note_document->height = header->height;
+	note_document->page_count = header->page_count;
+	note_document->reflowable = header->reflowable;
+
+#define LENGTH(id) (header->sections[id][1] / sizes[id])
+	note_model_t *model = &note_document->model;
+	model->objects_length = LENGTH(INDEX_CACHE_OBJECTS);
+	model->blocks_length = LENGTH(INDEX_CACHE_BLOCKS);
+	model->runs_length = LENGTH(INDEX_CACHE_RUNS);
+	model->strings_length = LENGTH(INDEX_CACHE_STRINGS);
+	model->global_block = header->global_block;
+	model->strokes.points_length = LENGTH(INDEX_CACHE_POINTS);
+	model->strokes.curves_length = LENGTH(INDEX_CACHE_NUM_POINTS);
+	model->strokes.palette_length = LENGTH(INDEX_CACHE_PALETTE);
+#undef LENGTH
+
+	// Everything referencing other sections must stay in bounds
+	unsigned int built = header->built;
+	if (model->global_block < -1 || model->global_block >= (int)model->blocks_length ||
+	    ((built & INDEX_CACHE_BUILT_STROKES) &&
+	     (header->sections[INDEX_CACHE_PAGE_CURVES][1] !=
+		      (header->page_count + 1) * sizes[INDEX_CACHE_PAGE_CURVES] ||
+	      header->sections[INDEX_CACHE_LOD_OFFSETS][1] !=
+		      (LOD_LEVELS - 1) * (model->strokes.curves_length + 1) *
+			      sizes[INDEX_CACHE_LOD_OFFSETS])) ||
+	    ((built & INDEX_CACHE_BUILT_OBJECTS) &&
+	     header->sections[INDEX_CACHE_PAGE_OBJECTS][1] !=
+		     (header->page_count + 1) * sizes[INDEX_CACHE_PAGE_OBJECTS]))
+		goto stale;
+	size_t lengths[INDEX_CACHE_SECTIONS];
+	note_cache_lengths(note_document, built, lengths);
+	for (int i = 0; i < INDEX_CACHE_SECTIONS; i++)
+		if (header->sections[i][1] != lengths[i] * sizes[i])
+			goto stale;
+	if (!note_cache_check_model(model) ||
+	    !note_cache_check_index(note_document, built, lengths))
+		goto stale;
+
+	// Missing parts are built on the first render like without a cache
+	for (int i = 0; i < INDEX_CACHE_SECTIONS; i++)
+		if (note_cache_section_part(i) & ~built)
+			*data[i] = 0;
+
+	// The whole layout depends on the width, only the line breaks are worth keeping
+	if (note_document->reflowable && header->width != note_document->reflow_width) {
+		size_t length = note_reflow_length(note_document);
+		note_arena_t *arena = &note_document->arena;
+		hint->width = header->width;
+		hint->lines = note_arena_copy(arena, note_document->run_lines,
+					      length * sizeof(*note_document->run_lines));
+		hint->widths = note_arena_copy(arena, note_document->run_widths,
+					       length * sizeof(*note_document->run_widths));
+		goto stale;
 	}
+	note_strokes_measure(&model->strokes);
+
+	note_document->cache_map = map;
+	note_document->cache_map_length = map_length;
+	note_document->cache_built = built;
+	return 1;
+
+stale:
+	munmap(map, map_length);
+	memset(&note_document->model, 0, sizeof(note_document->model));
+	note_document->curve_refs = 0;
+	note_document->page_curves = 0;
+	note_document->lod_offsets = 0;
+	note_document->lod_points = 0;
+	note_document->object_refs = 0;
+	note_document->page_objects = 0;
+	note_document->run_lines = 0;
+	note_document->run_widths = 0;
+	note_document->reflowable = 0;
+	return 0;
+}
 
-	while (jpeg.output_scanline < jpeg.output_height) {
-		unsigned char *row_address =
-			cairo_image_surface_get_data(surface) +
-			(jpeg.output_scanline * cairo_image_surface_get_stride(surface));
-		JSAMPROW row_pointer = row_address;
-		jpeg_read_scanlines(&jpeg, &row_pointer, 1);
-#ifndef LIBJPEG_TURBO_VERSION
-		pix_conv(row_address, 4, row_address, 3, jpeg.output_width);
-#endif
+static int note_cache_write_section(FILE *file, const void *data, size_t length, uint64_t *offset)
+{
+	static const char padding[INDEX_CACHE_ALIGN] = { 0 };
+	size_t pad = (INDEX_CACHE_ALIGN - *offset % INDEX_CACHE_ALIGN) % INDEX_CACHE_ALIGN;
+	if (fwrite(padding, 1, pad, file) != pad ||
+	    (length && fwrite(data, 1, length, file) != length))
+		return 0;
+	*offset += pad;
+	return 1;
+}
+
+// Writes the model and the parts of the index that have been built, closing shouldn't
+// pay for indexing pages that were never looked at
+static void note_cache_save(note_document_t *note_document)
+{
+	char *dir = g_path_get_dirname(note_document->cache_path);
+	g_mkdir_with_parents(dir, 0700);
+	g_free(dir);
+
+	// Written to a temporary file first, as other instances may read the cache
+	char *temporary = g_strdup_printf("%s.%d", note_document->cache_path, (int)getpid());
+	FILE *file = fopen(temporary, "wb");
+	if (!file) {
+		g_free(temporary);
+		return;
 	}
 
-	cairo_surface_mark_dirty(surface);
-	jpeg_finish_decompress(&jpeg);
-	jpeg_destroy_decompress(&jpeg);
+	note_cache_header_t header = { 0 };
+	memcpy(header.magic, note_cache_magic, sizeof(header.magic));
+	header.version = INDEX_CACHE_VERSION;
+	header.byte_order = INDEX_CACHE_BYTE_ORDER;
+	header.crc = note_document->session_crc;
+	header.size = note_document->session_size;
+	header.width = note_document->width;
+	header.height = note_document->height;
+	header.page_count = note_document->page_count;
+	header.global_block = note_document->model.global_block;
+	header.reflowable = note_document->reflowable;
+	header.built = note_cache_built(note_document);
+
+	void **data[INDEX_CACHE_SECTIONS];
+	size_t sizes[INDEX_CACHE_SECTIONS], lengths[INDEX_CACHE_SECTIONS];
+	note_cache_sections(note_document, data, sizes);
+	note_cache_lengths(note_document, header.built, lengths);
+
+	int ok = fwrite(&header, sizeof(header), 1, file) == 1;
+	uint64_t offset = sizeof(header);
+	for (int i = 0; ok && i < INDEX_CACHE_SECTIONS; i++) {
+		header.sections[i][1] = lengths[i] * sizes[i];
+		ok = note_cache_write_section(file, *data[i], header.sections[i][1], &offset);
+		header.sections[i][0] = offset;
+		offset += header.sections[i][1];
+	}
 
-	cairo_surface_set_mime_data(surface, CAIRO_MIME_TYPE_JPEG, data, len, free, data);
+	// Now that the offsets are known
+	ok = ok && !fseek(file, 0, SEEK_SET) && fwrite(&header, sizeof(header), 1, file) == 1;
+	ok = !fclose(file) && ok;
 
-	return surface;
+	if (!ok || rename(temporary, note_document->cache_path)) {
+		fprintf(stderr, "Couldn't write index cache '%s'\n", note_document->cache_path);
+		unlink(temporary);
+	}
+	g_free(temporary);
 }
 
 /**
  * Main zathura plugin implementations
  */
 
+// Compiles the model from Session.plist, reflowing it if the document is reflowable
+static zathura_error_t note_document_load_session(note_document_t *note_document,
+						  const note_reflow_hint_t *hint,
+						  note_profile_t *profile)
+{
+	// Nothing is taken from Session.plist without copying, it's released right after
+	note_plist_t plist;
+	note_blob_t session;
+	zathura_error_t session_error = plist_load(&note_document->archive, &plist, &session,
+						   "Session.plist", profile);
+	if (session_error != ZATHURA_ERROR_OK)
+		return session_error;
+
+	note_document->width = plist_page_width(&plist, &note_document->reflowable);
+	if (note_document->reflowable)
+		note_document->width = note_document->reflow_width;
+	if (note_document->width < 1) {
+		fprintf(stderr, "Setting invalid width %f to 500\n", note_document->width);
+		note_document->width = 500;
+	}
+	note_document->height = note_document->width * plist_page_ratio(&plist);
+
+	note_profile_begin(profile, NOTE_PHASE_COMPILE);
+	note_model_compile(&plist, &note_document->model, &note_document->arena);
+	note_profile_end(profile, NOTE_PHASE_COMPILE);
+	plist_close(&plist);
+	note_archive_release(&note_document->archive, &session);
+	note_archive_trim(&note_document->archive);
+	note_document->compiled = 1;
+	note_document->page_count = note_page_count(&note_document->model.strokes,
+						    note_document->height);
+	if (!note_document->reflowable)
+		return ZATHURA_ERROR_OK;
+
+	// The text decides how long a reflowed document is, not just the handwriting
+	note_document_reflow(note_document, hint, profile);
+	note_document_paginate_text(note_document);
+	int text_pages = (int)(note_document->run_y[note_reflow_length(note_document)] /
+			       note_document->height) +
+			 1;
+	if (text_pages > note_document->page_count)
+		note_document->page_count = text_pages;
+	return ZATHURA_ERROR_OK;
+}
+
+/**
+ * Reload
+ */
+
+// Zathura reloads a changed document by closing and opening it again, so the image and
+// tile caches of the last closed document are kept for reopening the same file. Their
+// keys include the CRCs of the entries they were made of: Whatever changed simply isn't
+// hit anymore and ages out, everything else is reused.
+static struct {
+	GMutex lock;
+	char *path; // Absolute, 0 if nothing is kept
+	note_image_cache_t images, tiles;
+} note_reload;
+
+static void note_reload_stash(note_document_t *note_document, const char *path)
+{
+	char *absolute = realpath(path, NULL);
+	if (!absolute)
+		return;
+
+	g_mutex_lock(&note_reload.lock);
+	if (!note_reload.images.images) {
+		note_image_cache_init(&note_reload.images, SIZE_MAX);
+		note_image_cache_init(&note_reload.tiles, SIZE_MAX);
+	}
+	note_image_cache_trim(&note_reload.images, 0);
+	note_image_cache_trim(&note_reload.tiles, 0);
+	note_image_cache_swap(&note_reload.images, &note_document->images);
+	note_image_cache_swap(&note_reload.tiles, &note_document->tiles);
+	free(note_reload.path);
+	note_reload.path = absolute;
+	g_mutex_unlock(&note_reload.lock);
+}
+
+// Takes over what the last closed document kept if it's the same file, drops it otherwise
+static void note_reload_restore(note_document_t *note_document, const char *path)
+{
+	char *absolute = realpath(path, NULL);
+	g_mutex_lock(&note_reload.lock);
+	if (note_reload.path) {
+		if (absolute && !strcmp(absolute, note_reload.path)) {
+			note_image_cache_swap(&note_reload.images, &note_document->images);
+			note_image_cache_swap(&note_reload.tiles, &note_document->tiles);
+			note_image_cache_trim(&note_document->images, note_document->images.budget);
+			note_image_cache_trim(&note_document->tiles, note_document->tiles.budget);
+		}
+		note_image_cache_trim(&note_reload.images, 0);
+		note_image_cache_trim(&note_reload.tiles, 0);
+		free(note_reload.path);
+		note_reload.path = 0;
+	}
+	g_mutex_unlock(&note_reload.lock);
+	free(absolute);
+}
+
+/**
+ * Memory budget
+ */
+
+// Lets the page be prefetched again (every page if page is -1), after what it prefetched
+// may have been dropped
+static void note_document_forget_prefetch(note_document_t *note_document, int page)
+{
+	g_mutex_lock(&note_document->prefetch_lock);
+	if (note_document->prefetch_scales && page >= 0)
+		note_document->prefetch_scales[page] = 0;
+	else if (note_document->prefetch_scales)
+		memset(note_document->prefetch_scales, 0,
+		       note_document->page_count * sizeof(*note_document->prefetch_scales));
+	g_mutex_unlock(&note_document->prefetch_lock);
+}
+
+// The caches have budgets of their own, this one bounds all of them together with the
+// model and index: Whichever cache has the least recently used entry is evicted from
+// until everything fits. Takes the cache locks one at a time, so call it without any.
+static void note_document_fit_budget(note_document_t *note_document)
+{
+	note_text_cache_t *texts = &note_document->texts;
+	size_t budget = note_document->memory_budget;
+	if (!budget)
+		return;
+
+	g_mutex_lock(&note_document->index_lock);
+	size_t fixed = note_document->arena.size;
+	g_mutex_unlock(&note_document->index_lock);
+
+	size_t floor = budget / MEMORY_BUDGET_CACHE_SHARE;
+	size_t caches = fixed < budget - floor ? budget - fixed : floor;
+	if (fixed > budget &&
+	    g_atomic_int_compare_and_exchange(&note_document->memory_warned, 0, 1))
+		fprintf(stderr, "Model and index take %lu MiB, more than the memory budget\n",
+			fixed >> 20);
+
+	// Which pages the evicted entries belonged to isn't known, all of them are forgotten
+	int evicted = 0;
+	for (;; evicted = 1) {
+		g_mutex_lock(&texts->lock);
+		size_t size = texts->size;
+		gint64 layout = texts->lru.length ?
+					texts->used[GPOINTER_TO_UINT(texts->lru.tail->data)] :
+					G_MAXINT64;
+		g_mutex_unlock(&texts->lock);
+		size += note_image_cache_size(&note_document->images) +
+			note_image_cache_size(&note_document->tiles);
+		if (size <= caches)
+			break;
+
+		gint64 image = note_image_cache_oldest(&note_document->images);
+		gint64 tile = note_image_cache_oldest(&note_document->tiles);
+		if (image == G_MAXINT64 && tile == G_MAXINT64 && layout == G_MAXINT64)
+			break; // Nothing is cached
+
+		if (image <= tile && image <= layout) {
+			note_image_cache_evict_oldest(&note_document->images);
+		} else if (tile <= layout) {
+			note_image_cache_evict_oldest(&note_document->tiles);
+		} else {
+			g_mutex_lock(&texts->lock);
+			if (texts->lru.length)
+				note_text_cache_evict(texts, &note_document->model);
+			g_mutex_unlock(&texts->lock);
+		}
+	}
+	if (evicted)
+		note_document_forget_prefetch(note_document, -1);
+}
+
+// A page that's cleared won't be drawn soon, so its tiles, images and layouts are the
+// first ones to go when the budget is exceeded
+static void note_document_demote_page(note_document_t *note_document, int page)
+{
+	const note_model_t *model = &note_document->model;
+	if (page >= note_document->page_count)
+		return;
+	note_document_forget_prefetch(note_document, page);
+
+	char prefix[1024];
+	snprintf(prefix, sizeof(prefix), "%08x:%d@", note_document->session_crc, page);
+	note_image_cache_demote(&note_document->tiles, prefix);
+
+	// Nothing of the page is cached if it was never prepared
+	g_mutex_lock(&note_document->index_lock);
+	int indexed = note_document->page_objects && note_document->run_y;
+	g_mutex_unlock(&note_document->index_lock);
+	if (!indexed)
+		return;
+
+	note_text_cache_t *texts = &note_document->texts;
+	for (unsigned int i = note_document->page_objects[page];
+	     i < note_document->page_objects[page + 1]; i++) {
+		const note_object_t *object = &model->objects[note_document->object_refs[i]];
+		if (object->type == NOTE_OBJECT_IMAGE) {
+			const char *path = &model->strings[object->path];
+			snprintf(prefix, sizeof(prefix), "%s@%08x@", path,
+				 note_image_crc(note_document, path));
+			note_image_cache_demote(&note_document->images, prefix);
+			continue;
+		}
+
+		const note_text_block_t *block = &model->blocks[object->block];
+		g_mutex_lock(&texts->lock);
+		for (unsigned int run = block->runs; run < block->runs + block->runs_length; run++)
+			note_text_cache_demote(texts, run);
+		g_mutex_unlock(&texts->lock);
+	}
+
+	if (model->global_block < 0)
+		return;
+
+	const note_text_block_t *block = &model->blocks[model->global_block];
+	double start = page * note_document->height, end = start + note_document->height;
+	g_mutex_lock(&texts->lock);
+	for (size_t i = note_document_first_run(note_document, start);
+	     i < block->runs_length && note_document->run_y[i] <= end; i++)
+		note_text_cache_demote(texts, block->runs + i);
+	g_mutex_unlock(&texts->lock);
+}
+
 GIRARA_HIDDEN zathura_error_t note_document_open(zathura_document_t *document)
 {
 	zathura_error_t error = ZATHURA_ERROR_OK;
@@ -451,9 +3838,13 @@ GIRARA_HIDDEN zathura_error_t note_document_open(zathura_document_t *document)
 		return error;
 	}
 
+	// The consistency check reads the whole archive, which is slow on network shares
+	int zip_flags = ZIP_RDONLY;
+	if (env_flag("ZATHURA_NOTE_CHECK_ZIP"))
+		zip_flags |= ZIP_CHECKCONS;
+
 	int zip_err;
-	zip_t *zip =
-		zip_open(zathura_document_get_path(document), ZIP_CHECKCONS | ZIP_RDONLY, &zip_err);
+	zip_t *zip = zip_open(zathura_document_get_path(document), zip_flags, &zip_err);
 	if (!zip || zip_err) {
 		zip_error_t *err = zip_get_error(zip);
 		fprintf(stderr, "Couldn't open .note zip: (%d): %s\n", zip_err,
@@ -474,471 +3865,1208 @@ GIRARA_HIDDEN zathura_error_t note_document_open(zathura_document_t *document)
 		return ZATHURA_ERROR_INVALID_ARGUMENTS;
 	}
 
-	note_document_t *note_document = malloc(sizeof(*note_document));
+	note_document_t *note_document = calloc(1, sizeof(*note_document));
+	note_archive_open(&note_document->archive, zip, zathura_document_get_path(document),
+			  root_name);
+	free(root_name);
+
+	const note_archive_entry_t *session =
+		note_archive_entry(&note_document->archive, "Session.plist");
+	if (session) {
+		note_document->session_crc = session->crc;
+		note_document->session_size = session->size;
+	}
+
+	// The stroke index is built on demand, see note_document_prepare
+	g_mutex_init(&note_document->index_lock);
+
+	note_profile_open(note_document);
+	note_profile_t profile;
+	note_profile_init(&profile, &note_document->profile);
+	note_profile_begin(&profile, NOTE_PHASE_OPEN);
+
+	// A valid cache has everything rendering needs, no need to touch Session.plist
+	const char *path = zathura_document_get_path(document);
+	note_document->reflow_width = env_number("ZATHURA_NOTE_REFLOW_WIDTH", REFLOW_WIDTH);
+	if (note_document->reflow_width < 1)
+		note_document->reflow_width = REFLOW_WIDTH;
+	note_reflow_hint_t hint = { 0 };
+	int cached = 0;
+	if (note_cache_key(note_document, path)) {
+		note_profile_begin(&profile, NOTE_PHASE_CACHE_LOAD);
+		cached = note_cache_load(note_document, &hint);
+		note_profile_end(&profile, NOTE_PHASE_CACHE_LOAD);
+	}
+	if (!cached) {
+		zathura_error_t session_error =
+			note_document_load_session(note_document, &hint, &profile);
+		if (session_error != ZATHURA_ERROR_OK) {
+			note_profile_end(&profile, NOTE_PHASE_OPEN);
+			note_profile_merge(note_document, &profile, -1);
+			note_document_free(document, note_document);
+			return session_error;
+		}
+	}
+
+	note_image_cache_init(&note_document->images,
+			      env_mebibytes("ZATHURA_NOTE_IMAGE_CACHE", IMAGE_CACHE_BUDGET));
+	note_image_cache_init(&note_document->tiles,
+			      env_mebibytes("ZATHURA_NOTE_TILE_CACHE", TILE_CACHE_BUDGET));
+	note_reload_restore(note_document, path);
+	note_text_cache_init(&note_document->texts, note_document->model.runs_length,
+			     note_document->page_count);
+	if (note_document->reflowable && note_document->model.global_block >= 0) {
+		note_document->texts.wrap_block =
+			&note_document->model.blocks[note_document->model.global_block];
+		note_document->texts.wrap_width = note_document->width;
+	}
+	note_document->preview_scale = env_number("ZATHURA_NOTE_PREVIEW_SCALE", PREVIEW_SCALE);
+	note_document->prefetch_pages = env_number("ZATHURA_NOTE_PREFETCH", PREFETCH_PAGES);
+	note_document->memory_budget = env_mebibytes("ZATHURA_NOTE_MEMORY", MEMORY_BUDGET);
+	g_mutex_init(&note_document->prefetch_lock);
+
+	note_profile_end(&profile, NOTE_PHASE_OPEN);
+	note_profile_merge(note_document, &profile, -1);
+
+	zathura_document_set_data(document, note_document);
+	zathura_document_set_number_of_pages(document, note_document->page_count);
+
+	return ZATHURA_ERROR_OK;
+}
+
+GIRARA_HIDDEN zathura_error_t note_document_free(zathura_document_t *document, void *data)
+{
+	if (!data)
+		return ZATHURA_ERROR_OK;
+
+	note_document_t *note_document = data;
+
+	// Queued prefetch jobs return right away, running ones are waited for
+	if (note_document->prefetch_pool) {
+		g_atomic_int_set(&note_document->prefetch_closing, 1);
+		g_thread_pool_free(note_document->prefetch_pool, FALSE, TRUE);
+	}
+
+	note_profile_close(note_document, zathura_document_get_path(document));
+
+	if (note_document->images.images) {
+		note_reload_stash(note_document, zathura_document_get_path(document));
+		note_image_cache_clear(&note_document->images);
+		note_image_cache_clear(&note_document->tiles);
+		note_text_cache_clear(&note_document->texts);
+		g_mutex_clear(&note_document->prefetch_lock);
+		free(note_document->prefetch_scales);
+	}
+
+	// A cache without the index is written again once it's been built, from the map
+	if (note_document->cache_path &&
+	    (note_document->compiled ||
+	     (note_document->cache_map &&
+	      (note_cache_built(note_document) & ~note_document->cache_built))))
+		note_cache_save(note_document);
+	if (note_document->cache_map)
+		munmap(note_document->cache_map, note_document->cache_map_length);
+	g_free(note_document->cache_path);
+
+	note_arena_free(&note_document->arena);
+	note_archive_close(&note_document->archive);
+	g_mutex_clear(&note_document->index_lock);
+	free(note_document);
+	return ZATHURA_ERROR_OK;
+}
+
+GIRARA_HIDDEN zathura_error_t note_page_init(zathura_page_t *page)
+{
+	note_document_t *note_document = zathura_document_get_data(zathura_page_get_document(page));
+	zathura_page_set_width(page, note_document->width);
+	zathura_page_set_height(page, note_document->height);
+
+	double height = zathura_page_get_height(page);
+	unsigned int number = zathura_page_get_index(page);
+
+	note_page_t *note_page = malloc(sizeof(*note_page));
+	note_page->page = page;
+	note_page->number = number;
+	note_page->start = height * number;
+	note_page->end = height * (number + 1);
+	zathura_page_set_data(page, note_page);
+
+	return ZATHURA_ERROR_OK;
+}
+
+GIRARA_HIDDEN zathura_error_t note_page_clear(zathura_page_t *page, void *data)
+{
+	note_document_t *note_document = zathura_document_get_data(zathura_page_get_document(page));
+	const note_page_t *note_page = data;
+	if (note_document && note_page)
+		note_document_demote_page(note_document, note_page->number);
+	free(data);
+	return ZATHURA_ERROR_OK;
+}
+
+// Both decoders read the blob in place
+static cairo_surface_t *note_image_decode_blob(const note_blob_t *blob, char is_jpeg, int width,
+					       int height, note_profile_t *profile)
+{
+	note_profile_begin(profile, NOTE_PHASE_DECODE);
+	cairo_surface_t *surface = 0;
+	if (is_jpeg) {
+		surface = cairo_image_surface_create_from_jpeg_mem(blob->data, blob->length, width,
+								   height);
+	} else {
+		surface = cairo_image_surface_create_from_png_mem(blob->data, blob->length, width,
+								  height);
+	}
+	if (!surface) {
+		cairo_read_closure closure = { .data = blob->data, .length = blob->length };
+		surface = cairo_image_surface_create_from_png_stream(cairo_read, &closure);
+	}
+	note_profile_end(profile, NOTE_PHASE_DECODE);
+
+	if (!surface || cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS) {
+		fprintf(stderr, "Invalid surface from png stream\n");
+		cairo_surface_destroy(surface);
+		return 0;
+	}
+	note_profile_count(profile, NOTE_COUNTER_IMAGES_DECODED, 1);
+	return surface;
+}
+
+// Loads and decodes an image from the zip and scales it down to width/height pixels
+// Images aren't scaled up, painting does that without costing memory
+static cairo_surface_t *note_image_decode(note_document_t *note_document, const char *path,
+					  char is_jpeg, int width, int height,
+					  note_profile_t *profile)
+{
+	note_blob_t blob;
+	if (!note_archive_read(&note_document->archive, path, &blob, profile)) {
+		fprintf(stderr, "Invalid media object '%s' in zip\n", path);
+		return 0;
+	}
+
+	cairo_surface_t *surface = note_image_decode_blob(&blob, is_jpeg, width, height, profile);
+	note_archive_release(&note_document->archive, &blob);
+	if (!surface)
+		return 0;
+
+	if (cairo_image_surface_get_width(surface) <= width ||
+	    cairo_image_surface_get_height(surface) <= height)
+		return surface;
+
+	note_profile_begin(profile, NOTE_PHASE_SCALE);
+	cairo_surface_t *scaled = cairo_surface_scale(surface, width, height);
+	note_profile_end(profile, NOTE_PHASE_SCALE);
+	cairo_surface_destroy(surface);
+	return scaled;
+}
+
+// Tiles or partial redraws only need what intersects the clip
+static void note_render_clip(note_render_t *render)
+{
+	double x1, y1, x2, y2;
+	cairo_clip_extents(render->cairo, &x1, &y1, &x2, &y2);
+	render->clip = (note_bounds_t){ x1, y1 + render->page->start, x2,
+					y2 + render->page->start };
+}
+
+// Curves only need as much detail as the zoom can show, tiny pages are only previews
+static void note_render_detail(note_render_t *render)
+{
+	// The resolution of print and vector surfaces isn't known, so all of the detail
+	if (render->printing) {
+		render->lod = 0;
+		render->smooth = 1;
+		return;
+	}
+
+	double dx = 1, dy = 0;
+	cairo_user_to_device_distance(render->cairo, &dx, &dy);
+	double scale = sqrt(dx * dx + dy * dy);
+
+	if (scale < render->document->preview_scale)
+		render->preview = 1;
+	if (render->preview) {
+		render->lod = LOD_LEVELS - 1;
+		render->smooth = 0;
+		return;
+	}
+
+	render->lod = 0;
+	for (int level = LOD_LEVELS - 1; level > 0 && scale > 0; level--) {
+		if (lod_tolerances[level] * scale <= LOD_PIXEL_TOLERANCE) {
+			render->lod = level;
+			break;
+		}
+	}
+	render->smooth = scale >= BEZIER_SCALE;
+}
+
+static int note_render_visible(const note_render_t *render, float x1, float y1, float x2, float y2)
+{
+	const note_bounds_t *clip = &render->clip;
+	return x1 <= clip->x2 && x2 >= clip->x1 && y1 <= clip->y2 && y2 >= clip->y1;
+}
+
+static int note_render_object_visible(const note_render_t *render, const note_object_t *object)
+{
+	return note_render_visible(render, object->x, object->y, object->x + object->width,
+				   object->y + object->height);
+}
+
+// Small version of an image for previews, kept in the image cache next to the full sizes
+// Made from the decoded surface if there is one, so previews rarely have to decode
+static cairo_surface_t *note_image_thumbnail(note_document_t *note_document,
+					     const note_object_t *object, cairo_surface_t *decoded,
+					     note_profile_t *profile)
+{
+	const char *path = &note_document->model.strings[object->path];
+
+	char key[1024];
+	snprintf(key, sizeof(key), "%s@%08x@thumbnail", path, note_image_crc(note_document, path));
+	cairo_surface_t *thumbnail = note_image_cache_lookup(&note_document->images, key);
+	if (thumbnail)
+		return thumbnail;
+
+	int width = IMAGE_THUMBNAIL_SIZE, height = IMAGE_THUMBNAIL_SIZE;
+	if (object->width > object->height)
+		height = ceil(IMAGE_THUMBNAIL_SIZE * object->height / object->width);
+	else
+		width = ceil(IMAGE_THUMBNAIL_SIZE * object->width / object->height);
+
+	if (!decoded)
+		thumbnail = note_image_decode(note_document, path, object->is_jpeg, width, height,
+					      profile);
+	else if (cairo_image_surface_get_width(decoded) > width &&
+		 cairo_image_surface_get_height(decoded) > height)
+		thumbnail = cairo_surface_scale(decoded, width, height);
+	else
+		thumbnail = cairo_surface_reference(decoded);
+
+	if (thumbnail)
+		note_image_cache_insert(&note_document->images, key, thumbnail);
+	return thumbnail;
+}
 
-	// Load $objects from Session.plist from zip
-	plist_t session_plist;
-	zathura_error_t session_error = plist_load(zip, &session_plist, root_name, "Session.plist");
-	if (session_error != ZATHURA_ERROR_OK) {
-		free(note_document);
-		free(root_name);
-		return session_error;
-	}
-	note_document->objects = plist_dict_get_item(session_plist, "$objects");
-	if (!PLIST_IS_ARRAY(note_document->objects)) {
-		fprintf(stderr, "Invalid objects type\n");
-		free(note_document);
-		free(root_name);
-		return ZATHURA_ERROR_NOT_IMPLEMENTED;
+// Size an image covers on the target in pixels, 0 if it's too small to be drawn
+static int note_image_size(const note_object_t *object, const cairo_matrix_t *matrix,
+			   int *width, int *height)
+{
+	double device_width = object->width, device_height = object->height;
+	cairo_matrix_transform_distance(matrix, &device_width, &device_height);
+	*width = ceil(fabs(device_width));
+	*height = ceil(fabs(device_height));
+	return *width >= 1 && *height >= 1;
+}
+
+// Decoded image of width x height pixels from the cache or the zip (a new reference),
+// previews take the thumbnail instead of decoding
+static cairo_surface_t *note_image_get(note_document_t *note_document,
+				       const note_object_t *object, int width, int height,
+				       int preview, note_profile_t *profile)
+{
+	const char *path = &note_document->model.strings[object->path];
+
+	// Decoding and scaling is expensive, so try the cache first
+	char key[1024];
+	snprintf(key, sizeof(key), "%s@%08x@%dx%d", path, note_image_crc(note_document, path),
+		 width, height);
+	cairo_surface_t *surface = note_image_cache_lookup(&note_document->images, key);
+	if (!surface && preview)
+		surface = note_image_thumbnail(note_document, object, 0, profile);
+	if (surface) {
+		note_profile_count(profile, NOTE_COUNTER_IMAGE_CACHE_HITS, 1);
+		return surface;
 	}
 
-	note_document->zip = zip;
-	note_document->root_name = root_name;
+	surface = note_image_decode(note_document, path, object->is_jpeg, width, height, profile);
+	if (!surface)
+		return 0;
+	note_image_cache_insert(&note_document->images, key, surface);
 
-	note_document->width = plist_page_width(note_document->objects);
-	if (note_document->width < 1) {
-		fprintf(stderr, "Setting invalid width %f to 500\n", note_document->width);
-		note_document->width = 500;
-	}
-	note_document->height = note_document->width * plist_page_ratio(note_document->objects);
+	cairo_surface_t *thumbnail = note_image_thumbnail(note_document, object, surface, profile);
+	if (thumbnail)
+		cairo_surface_destroy(thumbnail);
+	return surface;
+}
 
-	zathura_document_set_data(document, note_document);
-	zathura_document_set_number_of_pages(document, plist_page_count(note_document->objects,
-									note_document->height));
+// Full resolution image with the file attached as mime data, so vector surfaces can embed
+// the original instead of the pixels (PDF does for JPEG, SVG for PNG), never cached
+static cairo_surface_t *note_image_original(note_document_t *note_document,
+					    const note_object_t *object, note_profile_t *profile)
+{
+	const char *path = &note_document->model.strings[object->path];
+	note_blob_t blob;
+	if (!note_archive_read(&note_document->archive, path, &blob, profile)) {
+		fprintf(stderr, "Invalid media object '%s' in zip\n", path);
+		return 0;
+	}
 
-	return ZATHURA_ERROR_OK;
+	// Without the copy the pixels are embedded instead, which is only bigger
+	cairo_surface_t *surface =
+		note_image_decode_blob(&blob, object->is_jpeg, INT_MAX, INT_MAX, profile);
+	unsigned char *copy = surface ? malloc(blob.length) : 0;
+	if (copy) {
+		memcpy(copy, blob.data, blob.length);
+		cairo_surface_set_mime_data(surface,
+					    object->is_jpeg ? CAIRO_MIME_TYPE_JPEG :
+							      CAIRO_MIME_TYPE_PNG,
+					    copy, blob.length, free, copy);
+	}
+	note_archive_release(&note_document->archive, &blob);
+
+	// Lets vector surfaces embed an image drawn on several pages only once
+	if (surface) {
+		char *id = g_strdup_printf("%s@%08x@%08x", path, note_document->session_crc,
+					   note_image_crc(note_document, path));
+		cairo_surface_set_mime_data(surface, CAIRO_MIME_TYPE_UNIQUE_ID,
+					    (unsigned char *)id, strlen(id), g_free, id);
+	}
+	return surface;
 }
 
-GIRARA_HIDDEN zathura_error_t note_document_free(zathura_document_t *document, void *data)
+static void note_page_render_image_object(note_render_t *render, const note_object_t *object)
 {
-	(void)document;
+	note_document_t *note_document = render->document;
+	const note_page_t *page = render->page;
 
-	if (!data)
-		return ZATHURA_ERROR_OK;
+	if (!note_object_on_page(object, page->start, page->end) ||
+	    !note_render_object_visible(render, object))
+		return;
 
-	note_document_t *note_document = data;
-	zip_close(note_document->zip);
-	free(note_document->root_name);
-	return ZATHURA_ERROR_OK;
+	cairo_matrix_t matrix;
+	cairo_get_matrix(render->cairo, &matrix);
+	int width, height;
+	if (!note_image_size(object, &matrix, &width, &height))
+		return;
+
+	note_profile_begin(render->profile, NOTE_PHASE_IMAGES);
+	cairo_surface_t *surface =
+		render->printing ?
+			note_image_original(note_document, object, render->profile) :
+			note_image_get(note_document, object, width, height, render->preview,
+				       render->profile);
+	if (!surface) {
+		note_profile_end(render->profile, NOTE_PHASE_IMAGES);
+		return;
+	}
+
+	cairo_t *cairo = render->cairo;
+	cairo_save(cairo);
+	cairo_translate(cairo, object->x, object->y - page->start);
+	cairo_scale(cairo, object->width / cairo_image_surface_get_width(surface),
+		    object->height / cairo_image_surface_get_height(surface));
+	cairo_set_source_surface(cairo, surface, 0, 0);
+	cairo_paint(cairo);
+	cairo_restore(cairo);
+	cairo_surface_destroy(surface);
+	note_profile_end(render->profile, NOTE_PHASE_IMAGES);
 }
 
-GIRARA_HIDDEN zathura_error_t note_page_init(zathura_page_t *page)
+// Expects the text cache to be locked
+static int note_page_render_text_run(note_render_t *render, const note_text_block_t *block,
+				     unsigned int run, float x, float y, float width)
 {
-	note_document_t *note_document = zathura_document_get_data(zathura_page_get_document(page));
-	zathura_page_set_width(page, note_document->width);
-	zathura_page_set_height(page, note_document->height);
+	const note_model_t *model = &render->document->model;
+	const note_text_run_t *text_run = &model->runs[run];
+	int font_size = text_run->font_size;
+	int height = note_text_run_height(&model->strings[block->text], text_run);
+	note_text_cache_t *cache = &render->document->texts;
+
+	// Shaping is the expensive part, previews show a box where text will be
+	if (render->preview && !cache->layouts[run]) {
+		float estimate = (text_run->end - text_run->start) * font_size * 0.5;
+		cairo_set_source_rgba(render->cairo, text_run->red, text_run->green,
+				      text_run->blue, text_run->alpha * 0.2);
+		cairo_rectangle(render->cairo, x, y - render->page->start + font_size / 2,
+				estimate < width ? estimate : width, height);
+		cairo_fill(render->cairo);
+		return height;
+	}
 
-	double height = zathura_page_get_height(page);
-	unsigned int number = zathura_page_get_index(page);
+	PangoLayout *layout = note_text_cache_layout(cache, model, block, run, render->profile);
 
-	note_page_t *note_page = malloc(sizeof(*note_page));
-	note_page->page = page;
-	note_page->start = height * number;
-	note_page->end = height * (number + 1);
-	zathura_page_set_data(page, note_page);
+	cairo_move_to(render->cairo, x, y - render->page->start + font_size / 2);
+	cairo_set_source_rgba(render->cairo, text_run->red, text_run->green, text_run->blue,
+			      text_run->alpha);
+	pango_cairo_show_layout(render->cairo, layout);
 
-	return ZATHURA_ERROR_OK;
+	return height;
 }
 
-GIRARA_HIDDEN zathura_error_t note_page_clear(zathura_page_t *page, void *data)
+static void note_page_render_text_block(note_render_t *render, int index, float x, float y,
+					float width)
 {
-	(void)page;
-	free(data);
-	return ZATHURA_ERROR_OK;
+	const note_model_t *model = &render->document->model;
+	note_text_cache_t *cache = &render->document->texts;
+
+	note_profile_begin(render->profile, NOTE_PHASE_TEXT);
+	g_mutex_lock(&cache->lock);
+	note_text_cache_update(cache, render->cairo);
+
+	const note_text_block_t *block = &model->blocks[index];
+	for (unsigned int i = block->runs; i < block->runs + block->runs_length; i++)
+		y += note_page_render_text_run(render, block, i, x, y, width);
+
+	g_mutex_unlock(&cache->lock);
+	note_profile_end(render->profile, NOTE_PHASE_TEXT);
 }
 
-static void note_page_render_image_object(note_page_t *page, int index)
+// Only the runs of the global text store that intersect the clip of this page
+static void note_page_render_global_text(note_render_t *render)
 {
-	note_document_t *note_document =
-		zathura_document_get_data(zathura_page_get_document(page->page));
-	plist_t objects = note_document->objects;
+	const note_document_t *note_document = render->document;
+	const note_model_t *model = &note_document->model;
+	const note_text_block_t *block = &model->blocks[model->global_block];
+	note_text_cache_t *cache = &render->document->texts;
 
-	char missing = 0;
-	plist_access(objects, 6, index, "figure", "FigureBackgroundObjectKey",
-		     "kImageObjectSnapshotKey", "imageIsMissing", &missing);
-	if (missing)
-		return;
+	float top = render->clip.y1 > render->page->start ? render->clip.y1 : render->page->start;
+	float bottom = render->clip.y2 < render->page->end ? render->clip.y2 : render->page->end;
 
-	const char *position = 0;
-	size_t position_length = 0;
-	plist_access(objects, 4, index, "documentContentOrigin", &position, &position_length);
-	float x, y;
-	plist_string_to_floats(position, &x, &y);
+	size_t low = note_document_first_run(note_document, top);
+	if (low >= block->runs_length || note_document->run_y[low] > bottom)
+		return;
 
-	const char *size = 0;
-	size_t size_length = 0;
-	plist_access(objects, 4, index, "unscaledContentSize", &size, &size_length);
-	float width, height;
-	plist_string_to_floats(size, &width, &height);
+	note_profile_begin(render->profile, NOTE_PHASE_TEXT);
+	g_mutex_lock(&cache->lock);
+	note_text_cache_update(cache, render->cairo);
+	for (size_t i = low; i < block->runs_length && note_document->run_y[i] <= bottom; i++)
+		note_page_render_text_run(render, block, block->runs + i, 0,
+					  note_document->run_y[i], note_document->width);
+	g_mutex_unlock(&cache->lock);
+	note_profile_end(render->profile, NOTE_PHASE_TEXT);
+}
 
-	if (y < page->start || y + height > page->end)
+static void note_page_render_text_object(note_render_t *render, const note_object_t *object)
+{
+	const note_page_t *page = render->page;
+	if (!note_object_on_page(object, page->start, page->end) ||
+	    !note_render_object_visible(render, object))
 		return;
 
-	const char *path = 0;
-	size_t path_length = 0;
-	plist_access(objects, 7, index, "figure", "FigureBackgroundObjectKey",
-		     "kImageObjectSnapshotKey", "relativePath", &path, &path_length);
+	note_page_render_text_block(render, object->block, object->x, object->y, object->width);
+}
 
-	char is_jpeg = 0; // 0 means png
-	plist_access(objects, 6, index, "figure", "FigureBackgroundObjectKey",
-		     "kImageObjectSnapshotKey", "saveAsJPEG", &is_jpeg);
+static void note_page_render_objects(note_render_t *render)
+{
+	const note_document_t *note_document = render->document;
+	const note_model_t *model = &note_document->model;
+	int page = render->page->number;
 
-	zip_t *zip = note_document->zip;
-	void *data;
-	size_t length;
-	zip_load(zip, note_document->root_name, path, &data, &length);
-	if (!data || !length) {
-		fprintf(stderr, "Invalid media object '%s' in zip\n", path);
-		return;
+	// Render the global text object
+	if (model->global_block >= 0)
+		note_page_render_global_text(render);
+
+	// Only the objects on this page, see note_document_index_objects
+	for (unsigned int i = note_document->page_objects[page];
+	     i < note_document->page_objects[page + 1]; i++) {
+		const note_object_t *object = &model->objects[note_document->object_refs[i]];
+		if (object->type == NOTE_OBJECT_IMAGE)
+			note_page_render_image_object(render, object);
+		else
+			note_page_render_text_object(render, object);
 	}
+}
 
-	cairo_surface_t *surface = 0;
-	if (is_jpeg) {
-		surface = cairo_image_surface_create_from_jpeg_mem(data, length);
-	} else {
-		cairo_read_closure closure = { .data = data, .length = length };
-		surface = cairo_image_surface_create_from_png_stream(cairo_read, &closure);
-	}
+static int note_render_curve_visible(const note_render_t *render, unsigned int curve)
+{
+	note_bounds_t bounds = note_curve_bounds(&render->document->model.strokes, curve);
+	return note_render_visible(render, bounds.x1, bounds.y1, bounds.x2, bounds.y2);
+}
 
-	if (!surface || cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS) {
-		fprintf(stderr, "Invalid surface from png stream\n");
-		return;
-	}
+static int note_curves_batchable(const note_strokes_t *strokes, unsigned int a, unsigned int b)
+{
+	return strokes->styles[a] == strokes->styles[b];
+}
 
-	surface = cairo_surface_scale(surface, width, height);
+static void note_page_set_stroke_style(cairo_t *cairo, const note_strokes_t *strokes,
+				       unsigned int curve)
+{
+	const note_stroke_style_t *style = note_curve_style(strokes, curve);
+	const char *color = style->color;
+	cairo_set_source_rgba(cairo, (float)(color[0] & 0xff) / 255,
+			      (float)(color[1] & 0xff) / 255, (float)(color[2] & 0xff) / 255,
+			      (float)(color[3] & 0xff) / 255);
+
+	// TODO: Fractional curve widths (?)
+	cairo_set_line_width(cairo, style->width);
+}
 
-	cairo_set_source_surface(page->cairo, surface, x, y - page->start);
-	cairo_paint(page->cairo);
-	cairo_surface_flush(surface);
-	cairo_surface_destroy(surface);
+// Catmull-Rom spline through the points, converted to cubic bezier segments
+static void note_page_add_smooth_curve(cairo_t *cairo, const float *curve, unsigned int length,
+				       double start)
+{
+	cairo_move_to(cairo, curve[0], curve[1] - start);
+	for (unsigned int i = 0; i + 1 < length; i++) {
+		const float *p0 = &curve[(i ? i - 1 : i) * 2];
+		const float *p1 = &curve[i * 2];
+		const float *p2 = &curve[(i + 1) * 2];
+		const float *p3 = &curve[(i + 2 < length ? i + 2 : i + 1) * 2];
+		cairo_curve_to(cairo, p1[0] + (p2[0] - p0[0]) / 6,
+			       p1[1] + (p2[1] - p0[1]) / 6 - start, p2[0] - (p3[0] - p1[0]) / 6,
+			       p2[1] - (p3[1] - p1[1]) / 6 - start, p2[0], p2[1] - start);
+	}
 }
 
-static void note_page_render_text_range_extract_range(plist_t objects, int range, int *start,
-						      int *end)
+// curve has room for the points of the longest curve
+static void note_page_add_curve(const note_render_t *render, const note_curve_ref_t *ref,
+				float *curve)
 {
-	const char *range_string = 0;
-	size_t range_length = 0;
-	plist_access(objects, 3, range, &range_string, &range_length);
-	float start_float, end_float;
-	plist_string_to_floats(range_string, &start_float, &end_float);
-	*start = (int)start_float;
-	*end = *start + (int)end_float;
+	const note_document_t *note_document = render->document;
+	const note_strokes_t *strokes = &note_document->model.strokes;
+	size_t offset = ref->offset;
+	const unsigned int length =
+		note_curve_decode(strokes, &offset, strokes->num_points[ref->curve], curve);
+	if (!length)
+		return;
+	double start = render->page->start;
+	cairo_t *cairo = render->cairo;
+
+	// Parts on neighbouring pages get clipped by cairo
+	if (render->lod > 0) {
+		size_t level = (render->lod - 1) * (strokes->curves_length + 1);
+		const unsigned int *offsets = &note_document->lod_offsets[level];
+		const unsigned int *kept = &note_document->lod_points[offsets[ref->curve]];
+		unsigned int kept_length = offsets[ref->curve + 1] - offsets[ref->curve];
+		if (!kept_length)
+			return;
+
+		cairo_move_to(cairo, curve[kept[0] * 2], curve[kept[0] * 2 + 1] - start);
+		for (unsigned int j = 1; j < kept_length; j++)
+			cairo_line_to(cairo, curve[kept[j] * 2], curve[kept[j] * 2 + 1] - start);
+		note_profile_count(render->profile, NOTE_COUNTER_POINTS_EMITTED, kept_length);
+	} else if (render->smooth && length > 2) {
+		note_page_add_smooth_curve(cairo, curve, length, start);
+		note_profile_count(render->profile, NOTE_COUNTER_POINTS_EMITTED, length);
+	} else {
+		cairo_move_to(cairo, curve[0], curve[1] - start);
+		for (unsigned int j = 2; j < length * 2; j += 2)
+			cairo_line_to(cairo, curve[j], curve[j + 1] - start);
+		note_profile_count(render->profile, NOTE_COUNTER_POINTS_EMITTED, length);
+	}
 }
 
-static void note_page_render_text_range_extract_font(plist_t objects, int font,
-						     const char **font_name, int *font_size)
+// Only the curves touching this page, see note_document_index_strokes
+// Returns the number of curves drawn
+static unsigned long note_page_stroke_curves(note_render_t *render)
 {
-	double floating_font_size = 0;
-	plist_t font_keys = plist_access(objects, 2, font, "NS.keys");
-	plist_array_iter font_iter;
-	plist_array_new_iter(font_keys, &font_iter);
-	int font_index = 0;
-	while (1) {
-		plist_t key_ptr;
-		plist_array_next_item(font_keys, font_iter, &key_ptr);
-		if (!key_ptr)
-			break;
+	note_document_t *note_document = render->document;
+	const note_strokes_t *strokes = &note_document->model.strokes;
+	const note_page_t *page = render->page;
+	cairo_t *cairo = render->cairo;
+
+	if (page->number >= note_document->page_count)
+		return 0;
 
-		size_t key_index;
-		plist_get_uid_val(key_ptr, &key_index);
+	unsigned int start = note_document->page_curves[page->number];
+	unsigned int end = note_document->page_curves[page->number + 1];
+	unsigned long culled = 0;
+	float *points = malloc(((size_t)strokes->max_points * 2 + 1) * sizeof(*points));
+	if (!points)
+		return 0;
 
-		const char *key = 0;
-		size_t key_length = 0;
-		plist_access(objects, 3, key_index, &key, &key_length);
-		if (!key)
+	// In drawing order, a run of opaque curves with the same style is stroked as one
+	// path. Translucent ones (e.g. highlighters) go one by one, their overlaps add up.
+	unsigned int previous = 0;
+	int open = 0; // Path contains opaque curves of previous' style
+	for (unsigned int i = start; i < end; i++) {
+		const note_curve_ref_t *ref = &note_document->curve_refs[i];
+		if (!note_render_curve_visible(render, ref->curve)) {
+			culled++;
 			continue;
+		}
 
-		if (!memcmp(key, "NSFontSizeAttribute", key_length)) {
-			plist_access(objects, 4, font, "NS.objects", font_index,
-				     &floating_font_size);
-		} else if (!memcmp(key, "NSFontNameAttribute", key_length)) {
-			size_t font_length; // idc, is 0-delimited anyways (I hope)
-			plist_access(objects, 5, font, "NS.objects", font_index, font_name,
-				     &font_length);
-		} else {
-			fprintf(stderr, "Unknown font attribute '%.*s', please report\n",
-				(int)key_length, key);
+		if (!open || !note_curves_batchable(strokes, previous, ref->curve)) {
+			if (open)
+				cairo_stroke(cairo);
+			note_page_set_stroke_style(cairo, strokes, ref->curve);
 		}
 
-		font_index++;
+		note_page_add_curve(render, ref, points);
+		previous = ref->curve;
+		open = (note_curve_style(strokes, ref->curve)->color[3] & 0xff) == 0xff;
+		if (!open)
+			cairo_stroke(cairo);
 	}
+	if (open)
+		cairo_stroke(cairo);
+	free(points);
 
-	*font_size = (int)floating_font_size;
+	note_profile_count(render->profile, NOTE_COUNTER_CURVES_CULLED, culled);
+	note_profile_count(render->profile, NOTE_COUNTER_CURVES_EMITTED, end - start - culled);
+	return end - start - culled;
 }
 
-static void note_page_render_text_range_extract_color(plist_t objects, int color, double *red,
-						      double *green, double *blue, double *alpha)
+// Tiles can stand in for the strokes if user space maps to the raster target by a plain
+// scale and the page starts on a device pixel, so tile pixels land on device pixels
+static int note_render_tileable(const note_render_t *render, double *scale)
 {
-	plist_access(objects, 3, color, "UIRed", red);
-	plist_access(objects, 3, color, "UIGreen", green);
-	plist_access(objects, 3, color, "UIBlue", blue);
-	plist_access(objects, 3, color, "UIAlpha", alpha);
+	cairo_t *cairo = render->cairo;
+	if (render->preview || render->printing || !render->document->tiles.budget ||
+	    cairo_surface_get_type(cairo_get_target(cairo)) != CAIRO_SURFACE_TYPE_IMAGE)
+		return 0;
+
+	double ox = 0, oy = 0, xx = 1, yx = 0, xy = 0, yy = 1;
+	cairo_user_to_device(cairo, &ox, &oy);
+	cairo_user_to_device_distance(cairo, &xx, &yx);
+	cairo_user_to_device_distance(cairo, &xy, &yy);
+	if (yx != 0 || xy != 0 || xx != yy || xx <= 0 || ox != floor(ox) || oy != floor(oy))
+		return 0;
+
+	*scale = xx;
+	return 1;
 }
 
-static int note_page_render_text_sub_range(note_page_t *page, const char *data, int range, int font,
-					   int other_attributes, int color, float x, float y)
+// Stroke layer of a tile, a 0x0 surface if no curve touches it
+static cairo_surface_t *note_page_render_tile(const note_render_t *render, double scale,
+					      int tx, int ty, int width, int height)
 {
-	note_document_t *note_document =
-		zathura_document_get_data(zathura_page_get_document(page->page));
-	plist_t objects = note_document->objects;
+	cairo_surface_t *tile = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+	cairo_t *cairo = cairo_create(tile);
+	cairo_translate(cairo, -tx * TILE_SIZE, -ty * TILE_SIZE);
+	cairo_scale(cairo, scale, scale);
+
+	note_render_t tile_render = *render;
+	double start = render->page->start;
+	tile_render.cairo = cairo;
+	tile_render.clip = (note_bounds_t){ tx * TILE_SIZE / scale, ty * TILE_SIZE / scale + start,
+					    (tx * TILE_SIZE + width) / scale,
+					    (ty * TILE_SIZE + height) / scale + start };
+	unsigned long emitted = note_page_stroke_curves(&tile_render);
+	cairo_destroy(cairo);
+	note_profile_count(render->profile, NOTE_COUNTER_TILES_RENDERED, 1);
 
-	int start, end;
-	note_page_render_text_range_extract_range(objects, range, &start, &end);
+	if (!emitted) {
+		cairo_surface_destroy(tile);
+		return cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 0, 0);
+	}
+	cairo_surface_flush(tile);
+	return tile;
+}
 
-	const char *font_name = 0;
-	int font_size = 0;
-	note_page_render_text_range_extract_font(objects, font, &font_name, &font_size);
+// Composites the visible tiles of the stroke layer, rendering and caching missing ones
+// Tiles are TILE_SIZE device pixels on a grid starting at the page origin
+static void note_page_render_stroke_tiles(note_render_t *render, double scale)
+{
+	note_document_t *note_document = render->document;
+	note_image_cache_t *tiles = &note_document->tiles;
+	const note_page_t *page = render->page;
+	cairo_t *cairo = render->cairo;
+	int width = ceil(note_document->width * scale);
+	int height = ceil(note_document->height * scale);
+
+	// Visible tiles in device pixels relative to the page
+	const note_bounds_t *clip = &render->clip;
+	double tile = TILE_SIZE / scale;
+	int tx1 = fmax(0, floor(clip->x1 / tile));
+	int ty1 = fmax(0, floor((clip->y1 - page->start) / tile));
+	int tx2 = fmin((width - 1) / TILE_SIZE, floor(clip->x2 / tile));
+	int ty2 = fmin((height - 1) / TILE_SIZE, floor((clip->y2 - page->start) / tile));
+
+	for (int ty = ty1; ty <= ty2; ty++) {
+		for (int tx = tx1; tx <= tx2; tx++) {
+			char key[64];
+			snprintf(key, sizeof(key), "%08x:%d@%.17g:%d,%d",
+				 note_document->session_crc, page->number, scale, tx, ty);
+			cairo_surface_t *surface = note_image_cache_lookup(tiles, key);
+			if (surface) {
+				note_profile_count(render->profile, NOTE_COUNTER_TILE_HITS, 1);
+			} else {
+				int w = width - tx * TILE_SIZE, h = height - ty * TILE_SIZE;
+				surface = note_page_render_tile(render, scale, tx, ty,
+								w < TILE_SIZE ? w : TILE_SIZE,
+								h < TILE_SIZE ? h : TILE_SIZE);
+				note_image_cache_insert(tiles, key, surface);
+			}
+
+			if (cairo_image_surface_get_width(surface)) {
+				cairo_save(cairo);
+				cairo_translate(cairo, tx * tile, ty * tile);
+				cairo_scale(cairo, 1 / scale, 1 / scale);
+				cairo_set_source_surface(cairo, surface, 0, 0);
+				cairo_pattern_t *pattern = cairo_get_source(cairo);
+				cairo_pattern_set_filter(pattern, CAIRO_FILTER_NEAREST);
+				cairo_paint(cairo);
+				cairo_restore(cairo);
+			}
+			cairo_surface_destroy(surface);
+		}
+	}
+}
 
-	// TODO: Extract line-spacing, boldness, underline, etc. from other_attributes
-	(void)other_attributes;
+static void note_page_render_strokes(note_render_t *render)
+{
+	double scale;
+	note_profile_begin(render->profile, NOTE_PHASE_STROKES);
+	if (note_render_tileable(render, &scale))
+		note_page_render_stroke_tiles(render, scale);
+	else
+		note_page_stroke_curves(render);
+	note_profile_end(render->profile, NOTE_PHASE_STROKES);
+}
 
-	double red, green, blue, alpha;
-	note_page_render_text_range_extract_color(objects, color, &red, &green, &blue, &alpha);
+// Page to prepare in the background
+typedef struct {
+	int page;
+	cairo_matrix_t matrix; // Of the render that queued the job
+} note_prefetch_job_t;
 
-	PangoFontDescription *description = pango_font_description_new();
-	pango_font_description_set_absolute_size(description, font_size * PANGO_SCALE); // TODO: ?
-	pango_font_description_set_family_static(description, font_name);
+// Whether the user went somewhere else since the job was queued
+static int note_prefetch_stale(note_document_t *note_document, int page)
+{
+	int center = g_atomic_int_get(&note_document->prefetch_center);
+	return g_atomic_int_get(&note_document->prefetch_closing) ||
+	       abs(page - center) > note_document->prefetch_pages;
+}
 
-	PangoLayout *layout = pango_cairo_create_layout(page->cairo);
-	pango_layout_set_font_description(layout, description);
-	pango_layout_set_text(layout, data + start, end - start);
+// Shapes a layout with the font options of the last render
+static void note_prefetch_layout(note_document_t *note_document, const note_text_block_t *block,
+				 unsigned int run, note_profile_t *profile)
+{
+	note_text_cache_t *cache = &note_document->texts;
+	g_mutex_lock(&cache->lock);
+	if (cache->font_options && !cache->layouts[run]) {
+		PangoLayout *layout =
+			note_text_cache_layout(cache, &note_document->model, block, run, profile);
+		pango_layout_get_line_count(layout); // Shapes
+	}
+	g_mutex_unlock(&cache->lock);
+}
 
-	cairo_move_to(page->cairo, x, y - page->start + font_size / 2);
-	cairo_set_source_rgb(page->cairo, red, green, blue);
-	pango_cairo_show_layout(page->cairo, layout);
+static void note_prefetch_page(note_document_t *note_document, const note_prefetch_job_t *job,
+			       note_profile_t *profile)
+{
+	const note_model_t *model = &note_document->model;
+	double start = job->page * note_document->height;
+	double end = start + note_document->height;
+
+	note_document_prepare(note_document);
+
+	for (unsigned int i = note_document->page_objects[job->page];
+	     i < note_document->page_objects[job->page + 1]; i++) {
+		const note_object_t *object = &model->objects[note_document->object_refs[i]];
+		if (note_prefetch_stale(note_document, job->page))
+			return;
+
+		if (object->type == NOTE_OBJECT_TEXT) {
+			const note_text_block_t *block = &model->blocks[object->block];
+			for (unsigned int run = block->runs; run < block->runs + block->runs_length;
+			     run++)
+				note_prefetch_layout(note_document, block, run, profile);
+			continue;
+		}
 
-	int height = pango_layout_get_line_count(layout) * font_size;
+		int width, height;
+		if (!note_image_size(object, &job->matrix, &width, &height))
+			continue;
+		cairo_surface_t *surface =
+			note_image_get(note_document, object, width, height, 0, profile);
+		if (surface)
+			cairo_surface_destroy(surface);
+	}
 
-	pango_font_description_free(description);
-	g_object_unref(layout);
+	if (model->global_block < 0)
+		return;
 
-	return height;
+	const note_text_block_t *block = &model->blocks[model->global_block];
+	for (size_t i = note_document_first_run(note_document, start);
+	     i < block->runs_length && note_document->run_y[i] <= end; i++)
+		note_prefetch_layout(note_document, block, block->runs + i, profile);
 }
 
-static void note_page_render_text_store(note_page_t *page, int index, float x, float y, float width,
-					float height)
+static void note_prefetch_run(gpointer data, gpointer user_data)
 {
-	note_document_t *note_document =
-		zathura_document_get_data(zathura_page_get_document(page->page));
-	plist_t objects = note_document->objects;
-
-	const char *data = 0;
-	size_t data_length = 0;
-	plist_access(objects, 8, index, "NBAttributedBackingString", // TODO: Don't assume 0/1?
-		     "NBAttributedBackingStringCodingKey", "NS.objects", 0, "NS.bytes", &data,
-		     &data_length);
-	if (!data || !data_length)
+	note_prefetch_job_t *job = data;
+	note_document_t *note_document = user_data;
+
+	if (note_prefetch_stale(note_document, job->page)) {
+		// Can be queued again once it's close enough
+		g_mutex_lock(&note_document->prefetch_lock);
+		note_document->prefetch_scales[job->page] = 0;
+		g_mutex_unlock(&note_document->prefetch_lock);
+		free(job);
 		return;
+	}
 
-	plist_t array =
-		plist_access(objects, 6, index, "NBAttributedBackingString",
-			     "NBAttributedBackingStringCodingKey", "NS.objects", 1, "NS.objects");
-	if (!PLIST_IS_ARRAY(array))
+	note_profile_t profile;
+	note_profile_init(&profile, &note_document->profile);
+	note_profile_begin(&profile, NOTE_PHASE_PREFETCH);
+	note_prefetch_page(note_document, job, &profile);
+	note_document_fit_budget(note_document);
+	note_profile_end(&profile, NOTE_PHASE_PREFETCH);
+	note_profile_merge(note_document, &profile, job->page);
+	free(job);
+}
+
+// Decodes images and shapes text of the pages around a rendered
+// page on a worker pool, so scrolling finds them ready
+static void note_document_prefetch(note_document_t *note_document, const note_render_t *render)
+{
+	int pages = note_document->prefetch_pages;
+	int page = render->page->number;
+	if (pages <= 0)
 		return;
 
-	plist_array_iter iter;
-	plist_array_new_iter(array, &iter);
-	while (1) {
-		plist_t val;
-		plist_array_next_item(array, iter, &val);
-		if (!val)
-			break;
+	g_atomic_int_set(&note_document->prefetch_center, page);
 
-		size_t elem_index;
-		plist_get_uid_val(val, &elem_index);
+	cairo_matrix_t matrix;
+	cairo_get_matrix(render->cairo, &matrix);
+	double scale = hypot(matrix.xx, matrix.yx);
 
-		plist_t keys = plist_access(objects, 2, elem_index, "NS.keys");
-		if (!PLIST_IS_ARRAY(keys))
-			continue;
+	g_mutex_lock(&note_document->prefetch_lock);
+	if (!note_document->prefetch_pool) {
+		note_document->prefetch_pool = g_thread_pool_new(note_prefetch_run, note_document,
+								 PREFETCH_THREADS, FALSE, 0);
+		note_document->prefetch_scales =
+			calloc(note_document->page_count, sizeof(*note_document->prefetch_scales));
+	}
 
-		int color_cross_platform, range, font, other_attributes, color;
+	// Closest pages first, the next ones before the previous ones
+	note_document->prefetch_scales[page] = scale;
+	for (int distance = 1; distance <= pages; distance++) {
+		for (int direction = 1; direction >= -1; direction -= 2) {
+			int neighbour = page + distance * direction;
+			if (neighbour < 0 || neighbour >= note_document->page_count ||
+			    note_document->prefetch_scales[neighbour] == scale)
+				continue;
 
-		int index = 0;
-		plist_array_iter key_iter;
-		plist_array_new_iter(keys, &key_iter);
-		while (1) {
-			plist_t key_ptr;
-			plist_array_next_item(keys, key_iter, &key_ptr);
-			if (!key_ptr)
-				break;
+			note_prefetch_job_t *job = malloc(sizeof(*job));
+			job->page = neighbour;
+			job->matrix = matrix;
+			note_document->prefetch_scales[neighbour] = scale;
+			g_thread_pool_push(note_document->prefetch_pool, job, 0);
+		}
+	}
+	g_mutex_unlock(&note_document->prefetch_lock);
+}
 
-			size_t key_index;
-			plist_get_uid_val(key_ptr, &key_index);
+// Safe to call concurrently for different pages: All state of the call lives in
+// render, the model is immutable after opening and the caches/zip are locked
+static zathura_error_t note_page_render(zathura_page_t *page, void *data, cairo_t *cairo,
+					int preview, int printing)
+{
+	note_document_t *note_document = zathura_document_get_data(zathura_page_get_document(page));
+	note_profile_t profile;
+	note_profile_init(&profile, &note_document->profile);
+	note_profile_begin(&profile, NOTE_PHASE_RENDER);
+
+	note_render_t render = {
+		.document = note_document,
+		.page = data,
+		.cairo = cairo,
+		.preview = preview,
+		.printing = printing,
+		.profile = &profile,
+	};
+	note_render_clip(&render);
+	note_render_detail(&render);
+
+	if (render.page->number >= note_document->page_count)
+		goto end;
+	note_profile_begin(&profile, NOTE_PHASE_PREPARE);
+	note_document_prepare(note_document);
+	note_profile_end(&profile, NOTE_PHASE_PREPARE);
+
+	if (render.preview) {
+		note_profile_count(&profile, NOTE_COUNTER_PREVIEWS, 1);
+		cairo_save(cairo);
+		cairo_set_antialias(cairo, CAIRO_ANTIALIAS_FAST);
+	}
 
-			const char *key = 0;
-			size_t key_length = 0;
-			plist_access(objects, 3, key_index, &key, &key_length);
-			if (!key)
-				continue;
+	// Render all media objects (images, ...)
+	note_page_render_objects(&render);
 
-			plist_t object =
-				plist_access(objects, 3, elem_index, "NS.objects", index++);
-			int object_index = plist_array_get_item_index(object);
+	note_page_render_strokes(&render);
 
-			if (!memcmp(key, "subRangeColorCrossPlatformKey", key_length))
-				continue; // Seems irrelevant (always like "0.0,0.0,0.0,1.0")
-			else if (!memcmp(key, "subRangeRangeKey", key_length))
-				range = object_index;
-			else if (!memcmp(key, "subRangeFontKey", key_length))
-				font = object_index;
-			else if (!memcmp(key, "subRangeOtherAttributesKey", key_length))
-				other_attributes = object_index;
-			else if (!memcmp(key, "subRangeColorKey", key_length))
-				color = object_index;
-			else
-				fprintf(stderr,
-					"Unknown text sub range key '%.*s', please report\n",
-					(int)key_length, key);
-		}
+	// Printing goes through the pages once, there's nothing to prefetch for
+	if (render.preview)
+		cairo_restore(cairo);
+	else if (!render.printing)
+		note_document_prefetch(note_document, &render);
+	note_document_fit_budget(note_document);
 
-		y += note_page_render_text_sub_range(page, data, range, font, other_attributes,
-						     color, x, y);
-	}
+end:
+	note_profile_end(&profile, NOTE_PHASE_RENDER);
+	note_profile_merge(note_document, &profile, render.page->number);
+	return ZATHURA_ERROR_OK;
 }
 
-static void note_page_render_text_object(note_page_t *page, int index)
+GIRARA_HIDDEN zathura_error_t note_page_render_cairo(zathura_page_t *page, void *data,
+						     cairo_t *cairo, bool printing)
 {
-	note_document_t *note_document =
-		zathura_document_get_data(zathura_page_get_document(page->page));
-	plist_t objects = note_document->objects;
+	return note_page_render(page, data, cairo, 0, printing);
+}
 
-	const char *position = 0;
-	size_t position_length = 0;
-	plist_access(objects, 4, index, "documentContentOrigin", &position, &position_length);
-	float x, y;
-	plist_string_to_floats(position, &x, &y);
+GIRARA_HIDDEN zathura_error_t note_page_render_preview(zathura_page_t *page, void *data,
+						       cairo_t *cairo)
+{
+	return note_page_render(page, data, cairo, 1, 0);
+}
 
-	const char *size = 0;
-	size_t size_length = 0;
-	plist_access(objects, 4, index, "unscaledContentSize", &size, &size_length);
-	float width, height;
-	plist_string_to_floats(size, &width, &height);
+/**
+ * Text extraction and search
+ */
 
-	if (y < page->start || y + height > page->end)
-		return;
+// Collects the text of a page, grown with array_reserve
+typedef struct {
+	note_page_text_t *page_text;
+	size_t text_capacity, folded_capacity, folded_chars_capacity, chars_capacity;
+	double height; // Of the page, characters beyond it are on other pages
+} note_text_builder_t;
+
+static void note_text_builder_append(char **array, size_t *length, size_t *capacity,
+				     const char *data, size_t data_length)
+{
+	*array = array_reserve_many(*array, *length, data_length, capacity, 1);
+	memcpy(&(*array)[*length], data, data_length);
+	*length += data_length;
+}
 
-	plist_t text_store = plist_access(objects, 2, index, "textStore");
+// Adds the characters of a run whose layout is drawn at x, y in page coordinates
+// Expects the text cache to be locked
+static void note_text_builder_add_run(note_text_builder_t *builder,
+				      note_document_t *note_document,
+				      const note_text_block_t *block, unsigned int run, float x,
+				      float y, note_profile_t *profile)
+{
+	const note_model_t *model = &note_document->model;
+	const note_text_run_t *text_run = &model->runs[run];
+	PangoLayout *layout =
+		note_text_cache_layout(&note_document->texts, model, block, run, profile);
+	const char *text = &model->strings[block->text] + text_run->start;
+	size_t length = text_run->end - text_run->start;
+	note_page_text_t *page_text = builder->page_text;
+
+	for (size_t i = 0; i < length;) {
+		size_t next = g_utf8_next_char(&text[i]) - text;
+		if (next > length)
+			next = length;
+
+		PangoRectangle extents;
+		pango_layout_index_to_pos(layout, i, &extents);
+		if (extents.width < 0) { // Right to left
+			extents.x += extents.width;
+			extents.width = -extents.width;
+		}
+		note_text_char_t character = {
+			.x1 = x + (float)extents.x / PANGO_SCALE,
+			.y1 = y + (float)extents.y / PANGO_SCALE,
+			.x2 = x + (float)(extents.x + extents.width) / PANGO_SCALE,
+			.y2 = y + (float)(extents.y + extents.height) / PANGO_SCALE,
+			.start = page_text->text_length,
+		};
+		if (character.y2 < 0 || character.y1 > builder->height) {
+			i = next;
+			continue;
+		}
 
-	note_page_render_text_store(page, plist_array_get_item_index(text_store), x, y, width,
-				    height);
+		note_text_builder_append(&page_text->text, &page_text->text_length,
+					 &builder->text_capacity, &text[i], next - i);
+		character.end = page_text->text_length;
+
+		// Invalid UTF-8 can't be folded, it's kept as it is
+		char *casefolded = g_utf8_casefold(&text[i], next - i);
+		char *folded = g_utf8_normalize(casefolded, -1, G_NORMALIZE_ALL);
+		const char *append = folded ? folded : casefolded ? casefolded : &text[i];
+		size_t append_length = folded || casefolded ? strlen(append) : next - i;
+		note_text_builder_append(&page_text->folded, &page_text->folded_length,
+					 &builder->folded_capacity, append, append_length);
+		size_t folded_start = page_text->folded_length - append_length;
+		page_text->folded_chars = array_reserve_many(page_text->folded_chars, folded_start,
+							     append_length,
+							     &builder->folded_chars_capacity,
+							     sizeof(*page_text->folded_chars));
+		for (size_t j = folded_start; j < page_text->folded_length; j++)
+			page_text->folded_chars[j] = page_text->chars_length;
+		g_free(folded);
+		g_free(casefolded);
+
+		page_text->chars = array_reserve(page_text->chars, page_text->chars_length,
+						 &builder->chars_capacity,
+						 sizeof(*page_text->chars));
+		page_text->chars[page_text->chars_length++] = character;
+		i = next;
+	}
 }
 
-static void note_page_render_object(note_page_t *page, int index)
+// Text of the page, shaped and indexed on the first call and kept until the document
+// is closed, so queries don't touch Pango again. Expects the text cache to be locked
+// and the page to be prepared
+static const note_page_text_t *note_page_text(note_document_t *note_document, int page,
+					      note_profile_t *profile)
 {
-	note_document_t *note_document =
-		zathura_document_get_data(zathura_page_get_document(page->page));
-	plist_t objects = note_document->objects;
+	note_text_cache_t *cache = &note_document->texts;
+	if (cache->pages[page])
+		return cache->pages[page];
+
+	note_text_cache_default_options(cache);
+
+	note_text_builder_t builder = {
+		.page_text = calloc(1, sizeof(*builder.page_text)),
+		.height = note_document->height,
+	};
+	const note_model_t *model = &note_document->model;
+	double start = page * note_document->height, end = start + note_document->height;
+
+	// In drawing order: The global text store, then the text objects
+	if (model->global_block >= 0) {
+		const note_text_block_t *block = &model->blocks[model->global_block];
+		for (size_t i = note_document_first_run(note_document, start);
+		     i < block->runs_length && note_document->run_y[i] <= end; i++) {
+			int font_size = model->runs[block->runs + i].font_size;
+			float y = note_document->run_y[i] - start + font_size / 2;
+			note_text_builder_add_run(&builder, note_document, block, block->runs + i,
+						  0, y, profile);
+		}
+	}
 
-	const char *class = 0;
-	size_t class_length = 0;
-	plist_access(objects, 5, index, "$class", "$classname", &class, &class_length);
+	for (unsigned int i = note_document->page_objects[page];
+	     i < note_document->page_objects[page + 1]; i++) {
+		const note_object_t *object = &model->objects[note_document->object_refs[i]];
+		if (object->type != NOTE_OBJECT_TEXT)
+			continue;
 
-	if (!memcmp(class, "ImageMediaObject", class_length)) {
-		note_page_render_image_object(page, index);
-	} else if (!memcmp(class, "TextBlockMediaObject", class_length)) {
-		note_page_render_text_object(page, index);
-	} else {
-		fprintf(stderr, "Unknown media object type '%.*s', please report\n",
-			(int)class_length, class);
+		const note_text_block_t *block = &model->blocks[object->block];
+		float y = object->y;
+		for (unsigned int run = block->runs; run < block->runs + block->runs_length;
+		     run++) {
+			const note_text_run_t *text_run = &model->runs[run];
+			note_text_builder_add_run(&builder, note_document, block, run, object->x,
+						  y - start + text_run->font_size / 2, profile);
+			y += note_text_run_height(&model->strings[block->text], text_run);
+		}
 	}
+
+	// Terminated so queries can use strstr
+	note_page_text_t *page_text = builder.page_text;
+	note_text_builder_append(&page_text->text, &page_text->text_length,
+				 &builder.text_capacity, "", 1);
+	note_text_builder_append(&page_text->folded, &page_text->folded_length,
+				 &builder.folded_capacity, "", 1);
+	page_text->text_length--;
+	page_text->folded_length--;
+
+	// Kept and not counted against the memory budget, queries are too slow without them
+	cache->pages[page] = page_text;
+	return page_text;
 }
 
-// It doesn't really matter if something in here fails
-static void note_page_render_objects(note_page_t *page)
+static int note_text_char_is_newline(const note_page_text_t *page_text,
+				     const note_text_char_t *character)
 {
-	note_document_t *note_document =
-		zathura_document_get_data(zathura_page_get_document(page->page));
-	plist_t objects = note_document->objects;
+	return page_text->text[character->start] == '\n';
+}
 
-	// Render the global text object
-	note_page_render_text_store(page, SESSION_OBJECTS_GLOBAL_TEXT_STORE, 0, 0,
-				    zathura_page_get_width(page->page),
-				    zathura_page_get_height(page->page));
-
-	plist_t objects_array = plist_access(objects, 3, SESSION_OBJECTS_GLOBAL_TEXT_STORE,
-					     "mediaObjects", "NS.objects");
-
-	plist_array_iter iter;
-	plist_array_new_iter(objects_array, &iter);
-	while (1) {
-		plist_t val;
-		plist_array_next_item(objects_array, iter, &val);
-		if (!val)
-			break;
+// Adds one rectangle per line of the characters first..last to list
+static void note_page_text_rectangles(const note_page_text_t *page_text, unsigned int first,
+				      unsigned int last, girara_list_t *list)
+{
+	zathura_rectangle_t *rectangle = 0;
+	for (unsigned int i = first; i <= last; i++) {
+		const note_text_char_t *character = &page_text->chars[i];
+		if (note_text_char_is_newline(page_text, character))
+			continue;
+
+		if (rectangle && character->y1 == rectangle->y1 && character->y2 == rectangle->y2) {
+			rectangle->x1 = fmin(rectangle->x1, character->x1);
+			rectangle->x2 = fmax(rectangle->x2, character->x2);
+			continue;
+		}
 
-		size_t index;
-		plist_get_uid_val(val, &index);
-		note_page_render_object(page, index);
+		rectangle = g_malloc(sizeof(*rectangle));
+		*rectangle = (zathura_rectangle_t){ character->x1, character->y1, character->x2,
+						    character->y2 };
+		girara_list_append(list, rectangle);
 	}
 }
 
-GIRARA_HIDDEN zathura_error_t note_page_render_cairo(zathura_page_t *page, void *data,
-						     cairo_t *cairo, bool printing)
+// Prepares the page and locks its text, unlock the text cache when done
+static const note_page_text_t *note_page_text_lock(zathura_page_t *page, void *data,
+						   note_profile_t *profile)
 {
-	if (printing)
-		return ZATHURA_ERROR_NOT_IMPLEMENTED;
-
 	note_document_t *note_document = zathura_document_get_data(zathura_page_get_document(page));
-	note_page_t *note_page = data;
-	note_page->cairo = cairo;
+	const note_page_t *note_page = data;
+	if (note_page->number >= note_document->page_count)
+		return 0;
 
-	// Render all media objects (images, ...)
-	note_page_render_objects(note_page);
+	note_document_prepare(note_document);
+	g_mutex_lock(&note_document->texts.lock);
+	return note_page_text(note_document, note_page->number, profile);
+}
 
-	plist_t overlay = plist_handwriting_overlay(note_document->objects);
-	if (!overlay)
-		return ZATHURA_ERROR_OK;
+GIRARA_HIDDEN girara_list_t *note_page_search_text(zathura_page_t *page, void *data,
+						   const char *text, zathura_error_t *error)
+{
+	note_document_t *note_document = zathura_document_get_data(zathura_page_get_document(page));
+	char *casefolded = text && *text ? g_utf8_casefold(text, -1) : 0;
+	char *query = casefolded ? g_utf8_normalize(casefolded, -1, G_NORMALIZE_ALL) : 0;
+	g_free(casefolded);
+	if (!query || !*query) {
+		g_free(query);
+		if (error)
+			*error = ZATHURA_ERROR_INVALID_ARGUMENTS;
+		return 0;
+	}
 
-	/* plist_dump(note_document->objects, 0); */
-	/* return ZATHURA_ERROR_OK; */
-
-	// Array of points on curve
-	size_t curves_length = 0;
-	const float *curves = plist_dict_get_data(overlay, "curvespoints", &curves_length);
-
-	// Specifies the number of points of a curve (using index of *curves)
-	size_t curves_num_length = 0;
-	const unsigned int *curves_num =
-		plist_dict_get_data(overlay, "curvesnumpoints", &curves_num_length);
-
-	// Width of curves
-	size_t curves_width_length = 0;
-	const float *curves_width =
-		plist_dict_get_data(overlay, "curveswidth", &curves_width_length);
-
-	// Colors of curves
-	size_t curves_colors_length = 0;
-	const char *curves_colors =
-		plist_dict_get_data(overlay, "curvescolors", &curves_colors_length);
-
-	if (!curves || !curves_length || !curves_num || !curves_num_length || !curves_colors ||
-	    !curves_colors_length || !curves_width || !curves_width_length)
-		return ZATHURA_ERROR_OK; // Arrays are empty if no lines have been drawn - that's okay!
-
-	size_t limit = curves_num_length / sizeof(*curves_num);
-	unsigned int pos = 0;
-	for (size_t i = 0; i < limit; i++) {
-		const unsigned int length = curves_num[i];
-		const char *color = &curves_colors[i * 4];
-		cairo_set_source_rgba(cairo, (float)(color[0] & 0xff) / 255,
-				      (float)(color[1] & 0xff) / 255,
-				      (float)(color[2] & 0xff) / 255,
-				      (float)(color[3] & 0xff) / 255);
-
-		// TODO: Fractional curve widths (?)
-		cairo_set_line_width(cairo, curves_width[i]);
-
-		if (curves[pos + 1] >= note_page->start && curves[pos + 1] <= note_page->end)
-			cairo_move_to(cairo, curves[pos], curves[pos + 1] - note_page->start);
-
-		// TODO: Render as bezier curves
-		for (unsigned int j = pos; j < pos + length * 2; j += 2)
-			if (curves[j + 1] >= note_page->start && curves[j + 1] <= note_page->end)
-				cairo_line_to(cairo, curves[j], curves[j + 1] - note_page->start);
+	note_profile_t profile;
+	note_profile_init(&profile, &note_document->profile);
+	const note_page_text_t *page_text = note_page_text_lock(page, data, &profile);
+	girara_list_t *list = girara_list_new2(g_free);
+	size_t length = strlen(query);
+	if (page_text) {
+		for (const char *match = strstr(page_text->folded, query); match;
+		     match = strstr(match + length, query)) {
+			size_t offset = match - page_text->folded;
+			note_page_text_rectangles(page_text, page_text->folded_chars[offset],
+						  page_text->folded_chars[offset + length - 1],
+						  list);
+		}
+		g_mutex_unlock(&note_document->texts.lock);
+		note_document_fit_budget(note_document);
+	}
+	note_profile_merge(note_document, &profile, ((note_page_t *)data)->number);
+	g_free(query);
 
-		cairo_stroke(cairo);
-		pos += length * 2;
+	if (!girara_list_size(list)) {
+		girara_list_free(list);
+		if (error)
+			*error = ZATHURA_ERROR_UNKNOWN;
+		return 0;
 	}
+	return list;
+}
 
-	return ZATHURA_ERROR_OK;
+GIRARA_HIDDEN char *note_page_get_text(zathura_page_t *page, void *data,
+				       zathura_rectangle_t rectangle, zathura_error_t *error)
+{
+	note_document_t *note_document = zathura_document_get_data(zathura_page_get_document(page));
+	note_profile_t profile;
+	note_profile_init(&profile, &note_document->profile);
+	const note_page_text_t *page_text = note_page_text_lock(page, data, &profile);
+	if (!page_text) {
+		if (error)
+			*error = ZATHURA_ERROR_INVALID_ARGUMENTS;
+		return 0;
+	}
+
+	// Characters whose center is selected, a new line wherever the selection skips
+	GString *selected = g_string_new(0);
+	const note_text_char_t *previous = 0;
+	for (size_t i = 0; i < page_text->chars_length; i++) {
+		const note_text_char_t *character = &page_text->chars[i];
+		double x = (character->x1 + character->x2) / 2;
+		double y = (character->y1 + character->y2) / 2;
+		if (x < rectangle.x1 || x > rectangle.x2 || y < rectangle.y1 || y > rectangle.y2 ||
+		    note_text_char_is_newline(page_text, character))
+			continue;
+
+		if (previous && (previous + 1 != character || previous->y1 != character->y1))
+			g_string_append_c(selected, '\n');
+		g_string_append_len(selected, &page_text->text[character->start],
+				    character->end - character->start);
+		previous = character;
+	}
+	g_mutex_unlock(&note_document->texts.lock);
+	note_document_fit_budget(note_document);
+	note_profile_merge(note_document, &profile, ((note_page_t *)data)->number);
+	return g_string_free(selected, FALSE);
 }
@@ -0,0 +1,22 @@
+#ifndef NOTE_H
+#define NOTE_H
+
+#include "plugin.h"
+
+// Entry points of the renderer beyond the plugin API, for the tools linked against
+// note-core. zathura doesn't know about them.
+
+/**
+ * Renders a fast, rough preview of a page onto a cairo object: Coarsest stroke
+ * detail, fast antialiasing, image thumbnails and boxes for text that isn't shaped
+ * yet. Renders below ZATHURA_NOTE_PREVIEW_SCALE are previews automatically.
+ *
+ * @param page Page
+ * @param cairo Cairo object
+ * @return ZATHURA_ERROR_OK when no error occurred, otherwise see
+ *    zathura_error_t
+ */
+GIRARA_HIDDEN zathura_error_t note_page_render_preview(zathura_page_t *page, void *data,
+						       cairo_t *cairo);
+
+#endif
@@ -7,5 +7,7 @@ ZATHURA_PLUGIN_REGISTER_WITH_FUNCTIONS("note", VERSION_MAJOR, VERSION_MINOR, VER
 					       .page_init = note_page_init,
 					       .page_clear = note_page_clear,
 					       .page_render_cairo = note_page_render_cairo,
+					       .page_search_text = note_page_search_text,
+					       .page_get_text = note_page_get_text,
 				       }),
 				       ZATHURA_PLUGIN_MIMETYPES({ "application/zip" }))
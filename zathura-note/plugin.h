@@ -44,11 +44,35 @@ GIRARA_HIDDEN zathura_error_t note_page_clear(zathura_page_t *page, void *data);
  *
  * @param page Page
  * @param cairo Cairo object
- * @param printing Set to true if page should be rendered for printing
+ * @param printing Set to true if page should be rendered for printing (full detail,
+ *    original images attached as mime data for vector surfaces)
  * @return ZATHURA_ERROR_OK when no error occurred, otherwise see
  *    zathura_error_t
  */
 GIRARA_HIDDEN zathura_error_t note_page_render_cairo(zathura_page_t *page, void *data,
 						     cairo_t *cairo, bool printing);
 
+/**
+ * Searches the text of a page, case insensitively
+ *
+ * @param page Page
+ * @param text Search string
+ * @param error Set to an error value (see zathura_error_t) if an error occurred
+ * @return List of the rectangles of the matches, one per line, or NULL if nothing
+ *    was found
+ */
+GIRARA_HIDDEN girara_list_t *note_page_search_text(zathura_page_t *page, void *data,
+						   const char *text, zathura_error_t *error);
+
+/**
+ * Gets the text of a page inside a rectangle
+ *
+ * @param page Page
+ * @param rectangle Selection in page coordinates
+ * @param error Set to an error value (see zathura_error_t) if an error occurred
+ * @return The selected text (free with g_free) or NULL if an error occurred
+ */
+GIRARA_HIDDEN char *note_page_get_text(zathura_page_t *page, void *data,
+				       zathura_rectangle_t rectangle, zathura_error_t *error);
+
 #endif